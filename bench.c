@@ -0,0 +1,641 @@
+#include "ingest.h"
+#include "model.h"
+#include "predict.h"
+#include "score.h"
+#include "count.h"
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+
+/* File:        bench.c
+ * Description: Benchmarks for the table and the generator, run as
+ *        './bench {benchmark} [args]'.  Results go to stdout, one line each.
+ */
+
+/* Function:    now()
+ * Description: Monotonic time in seconds.
+ */
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Function:    open_counter()
+ * Description: Start counting a hardware event for this thread, -1 if the
+ *        kernel or the machine does not allow it.
+ */
+
+static int open_counter(unsigned type, unsigned long long config) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = type;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Function:    read_counter()
+ * Description: Current value of a counter, 0 if it could not be opened.
+ */
+
+static unsigned long long read_counter(int fd) {
+	unsigned long long v = 0;
+
+	if(fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+		return 0;
+	return v;
+}
+
+/* Function:    load_table()
+ * Description: Load a model or build the table from a corpus.
+ */
+
+static HASH_TABLE *load_table(const char *path) {
+	HASH_TABLE *ht = NULL;
+	INPUT	*in;
+
+	if(is_model(path))
+		ht = load_model(path);
+	else if((in = open_input(path))) {
+		ht = create_table();
+		insert_words(ht, in->fp, NULL);
+		close_input(in);
+	}
+	if(!ht) {
+		printf("could not load '%s'\n", path);
+		exit(1);
+	}
+	return ht;
+}
+
+/* Function:    bench_ingest()
+ * Description: Build a table from 'path' with the insert_words() pipeline,
+ *        with a mutex per bucket around insert_node() and with the lock-free
+ *        insert, and report the throughput of each.  The threaded totals are
+ *        checked against the serial ones: blocks are cut where parse() ends
+ *        a sentence and each starts parsing afresh, so they must match.  The
+ *        pipeline also reports its stages.
+ */
+
+static void bench_ingest(const char *path, unsigned threads) {
+	const char *name[] = {"serial", "atomic", "locked"};
+	HASH_TABLE *ht;
+	INPUT	*in;
+	STATS	st,
+		serial;
+	unsigned count = 0;
+	PIPE_STATS pstats;
+	double	t;
+	unsigned mode;
+
+	for(mode = INS_SERIAL; mode <= INS_LOCKED; mode++) {
+		if(!(in = open_input(path))) {
+			printf("could not find '%s'\n", path);
+			exit(1);
+		}
+		ht = create_table();
+		t = now();
+		if(mode == INS_SERIAL)
+			insert_words(ht, in->fp, &pstats);
+		else
+			insert_words_mt(ht, in->fp, threads, mode);
+		t = now() - t;
+		close_input(in);
+		table_stats(ht, &st);
+		printf("%-8s threads: %2u  %8.3fs  %7.2f Mwords/s  words: %u  unique: %u  precs: %u  succs: %u\n",
+			name[mode], mode == INS_SERIAL ? 1 : threads, t, ht->count / t / 1e6,
+			ht->count, st.words, st.precs, st.succs);
+		if(mode == INS_SERIAL) {
+			print_pipe_stats(&pstats, stdout);
+			serial = st;
+			count = ht->count;
+		}
+		else if(ht->count != count || st.words != serial.words || st.precs != serial.precs || st.succs != serial.succs)
+			printf("%-8s totals differ from serial\n", name[mode]);
+		clear_table(ht);
+		rem_table(ht);
+	}
+}
+
+/* Function:    latency_cmp()
+ * Description: qsort() comparison for latencies.
+ */
+
+static int latency_cmp(const void *x, const void *y) {
+	double	a = *(const double *)x,
+		b = *(const double *)y;
+
+	return (a > b) - (a < b);
+}
+
+/* Function:    bench_predict()
+ * Description: Index the table in 'path' (a model or a corpus) for
+ *        prediction and time 'queries' random top-k queries, each from the
+ *        words of the context to the probabilities of the top k.  Half of the
+ *        contexts are edges of the table, half are random word pairs that
+ *        mostly need to back off.  Reports the p50/p99 latency.
+ */
+
+static void bench_predict(const char *path, unsigned queries, unsigned k) {
+	HASH_TABLE *ht;
+	PREDICTOR *pd;
+	CONTEXT	*ctx;
+	NODE	*node,
+		**nodes;
+	PREC	*prec;
+	char	(*words)[2][64];
+	double	*lat,
+		t,
+		total = 0,
+		mass = 0;
+	unsigned n = 0,
+		i,
+		j,
+		found = 0;
+
+	ht = load_table(path);
+	t = now();
+	pd = create_predictor(ht);
+	printf("index:    %8.3fs  contexts: %zu  choices: %zu\n", now() - t, pd->used, pd->choices);
+
+	// the queries are drawn up front so only the lookups are timed
+	while(get_next_node(ht))
+		n++;
+	if(!n) {
+		printf("'%s' has no words\n", path);
+		exit(1);
+	}
+	nodes = malloc(n * sizeof(*nodes));
+	words = malloc(queries * sizeof(*words));
+	lat = malloc(queries * sizeof(*lat));
+	assert(nodes && words && lat);
+	for(i = 0; (node = get_next_node(ht)); i++)
+		nodes[i] = node;
+	srand(1);
+	for(i = 0; i < queries; i++) {
+		node = nodes[rand() % n];
+		prec = node->prec;
+		for(j = rand() % 4; prec && prec->next && j; j--)
+			prec = prec->next;
+		strcpy(words[i][0], i % 2 || !prec ? nodes[rand() % n]->word : prec->node->word);
+		strcpy(words[i][1], node->word);
+	}
+
+	for(i = 0; i < queries; i++) {
+		t = now();
+		ctx = predict(pd, find_node(ht, words[i][0]), find_node(ht, words[i][1]));
+		j = k < ctx->n ? k : ctx->n;
+		if(j)
+			mass += (double)ctx->choice[j - 1].cum / ctx->total;
+		lat[i] = now() - t;
+		total += lat[i];
+		found += ctx->a != NULL;
+	}
+	qsort(lat, queries, sizeof(*lat), latency_cmp);
+	printf("predict:  %u queries  top %u  %.1f%% order 2  %.1f%% of the mass  p50: %.0fns  p99: %.0fns  mean: %.0fns\n",
+		queries, k, 100.0 * found / queries, 100 * mass / queries, lat[queries / 2] * 1e9,
+		lat[queries / 100 * 99] * 1e9, total / queries * 1e9);
+
+	free(nodes);
+	free(words);
+	free(lat);
+	rem_predictor(pd);
+	clear_table(ht);
+	rem_table(ht);
+}
+
+static volatile unsigned long long sink;	// keeps generate()'s reads
+
+/* Function:    generate()
+ * Description: Emit 'words' words the way markov does, without printing:
+ *        pick each word from its context with backoff, read what
+ *        print_word() reads and decide on ending the sentence.  Times it
+ *        and counts cache misses, *l1 and *llc stay 0 without counters.
+ */
+
+static double generate(PREDICTOR *pd, unsigned words, unsigned long long *l1, unsigned long long *llc) {
+	CONTEXT	*ctx;
+	NODE	*node = NULL,
+		*prev = CTX_START;
+	uint64_t x = 88172645463325252ULL;	// xorshift64, same words every run
+	unsigned long long l1_0,
+		llc_0;
+	unsigned i;
+	double	t;
+	int	l1_fd = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+			PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		llc_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+#define DRAW()	(x ^= x << 13, x ^= x >> 7, x ^= x << 17, ldexp(x >> 11, -53))
+	l1_0 = read_counter(l1_fd);
+	llc_0 = read_counter(llc_fd);
+	t = now();
+	for(i = 0; i < words; i++) {
+		if(!node)
+			ctx = find_context(pd, CTX_START, NULL);
+		else if(!(ctx = find_context(pd, prev, node)) && !(ctx = find_context(pd, NULL, node)))
+			ctx = find_context(pd, CTX_START, NULL);
+		prev = node ? node : CTX_START;
+		node = sample(ctx, DRAW());
+		sink += node->punc.comma + node->shape[SHAPE_LOWER] + node->word[0];
+		if(node->last && DRAW() * node->freq < node->last) {
+			node = NULL;
+			prev = CTX_START;
+		}
+	}
+	t = now() - t;
+#undef DRAW
+	*l1 = read_counter(l1_fd) - l1_0;
+	*llc = read_counter(llc_fd) - llc_0;
+	if(l1_fd >= 0)
+		close(l1_fd);
+	if(llc_fd >= 0)
+		close(llc_fd);
+	return t;
+}
+
+/* Function:    bench_generate()
+ * Description: Generate from the predictor over the table as built or
+ *        loaded, and report time and L1/last level cache misses per emitted
+ *        word, the best of three runs.
+ */
+
+static void bench_generate(const char *path, unsigned words) {
+	HASH_TABLE *ht = load_table(path);
+	PREDICTOR *pd = create_predictor(ht);
+	unsigned long long l1,
+		llc,
+		best_l1,
+		best_llc;
+	unsigned run;
+	double	t,
+		best;
+
+	for(run = 0; run < 3; run++) {
+		t = generate(pd, words, &l1, &llc);
+		if(!run || t < best)
+			best = t;
+		if(!run || l1 < best_l1)
+			best_l1 = l1;
+		if(!run || llc < best_llc)
+			best_llc = llc;
+	}
+	if(best_l1 || best_llc)
+		printf("generate  %u words  %6.1f ns/word  L1 misses/word: %6.2f  LLC misses/word: %6.3f\n",
+			words, best / words * 1e9, (double)best_l1 / words, (double)best_llc / words);
+	else
+		printf("generate  %u words  %6.1f ns/word  cache misses: n/a (no hardware counters)\n",
+			words, best / words * 1e9);
+	rem_predictor(pd);
+	clear_table(ht);
+	rem_table(ht);
+}
+
+/* Function:    strcmp_chain()
+ * Description: The abbreviation test parse() used to make on every token.
+ */
+
+static unsigned strcmp_chain(const char *word) {
+	return !strcmp(word, "Ms.") || !strcmp(word, "Mrs.") || !strcmp(word, "Mr.");
+}
+
+/* Function:    bench_abbrev()
+ * Description: Time the abbreviation test over the tokens of 'path'
+ *        ending in a period, the only ones parse() asks about: the old
+ *        strcmp chain of three titles, a strcmp scan of a list of 'n'
+ *        abbreviations and the perfect hash compiled from the same list.
+ *        Reports Mtokens/s over all tokens and how many each matched.
+ */
+
+static void bench_abbrev(const char *path, unsigned n) {
+	const char *name[] = {"strcmp x3", "strcmp list", "perfect hash"};
+	char	(*tokens)[64] = NULL,
+		*text,
+		*pos,
+		(*list)[ABBREV_LEN];
+	const char **words;
+	FILE	*fp;
+	long	size;
+	size_t	count = 0,
+		cap = 0,
+		i,
+		len,
+		hits;
+	unsigned j,
+		k,
+		kind;
+	double	t;
+
+	if(!(fp = fopen(path, "rb"))) {
+		printf("could not find '%s'\n", path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	text = malloc(size + 1);
+	assert(text);
+	text[fread(text, 1, size, fp)] = '\0';
+	fclose(fp);
+	for(pos = text; ; count++) {
+		if(count == cap) {
+			cap = cap ? 2 * cap : 1 << 16;
+			tokens = realloc(tokens, cap * sizeof(*tokens));
+			assert(tokens);
+		}
+		if(!next_word(&pos, tokens[count], sizeof(*tokens)))
+			break;
+	}
+	free(text);
+
+	// Mr. Mrs. Ms. and made up titles up to 'n'
+	list = malloc(n * sizeof(*list));
+	words = malloc(n * sizeof(*words));
+	assert(list && words);
+	for(j = 0; j < n; j++) {
+		if(j < 3)
+			strcpy(list[j], j == 0 ? "Mr." : j == 1 ? "Mrs." : "Ms.");
+		else
+			snprintf(list[j], sizeof(*list), "Zq%u.", j);
+		words[j] = list[j];
+	}
+	set_abbrevs(words, n);
+
+	for(kind = 0; kind < 3; kind++) {
+		hits = 0;
+		t = now();
+		for(i = 0; i < count; i++) {
+			len = strlen(tokens[i]);
+			if(tokens[i][len - 1] != '.')
+				continue;
+			if(kind == 0)
+				hits += strcmp_chain(tokens[i]);
+			else if(kind == 1) {
+				for(k = 0; k < n; k++)
+					if(!strcmp(tokens[i], list[k])) {
+						hits++;
+						break;
+					}
+			}
+			else
+				hits += is_abbrev(tokens[i], len);
+		}
+		t = now() - t;
+		printf("%-12s  %5u words  %8.2f Mtokens/s  matched: %zu of %zu\n",
+			name[kind], kind ? n : 3, count / t / 1e6, hits, count);
+	}
+	free(tokens);
+	free(list);
+	free(words);
+}
+
+/* Function:    bench_tokenize()
+ * Description: Time what the tokenizer threads do to a block of text,
+ *        next_word() and make_token() on every word, over the whole of each
+ *        file in memory, best of three.  Reports MB/s, Mtokens/s and the
+ *        share of tokens holding bytes above 0x7f, which leave the ASCII path.
+ */
+
+static void bench_tokenize(char **paths, unsigned n) {
+	TOKEN	tok;
+	char	*text,
+		*pos,
+		*c;
+	FILE	*fp;
+	long	size;
+	size_t	count,
+		wide;
+	unsigned i,
+		run;
+	double	t,
+		best;
+
+	for(i = 0; i < n; i++) {
+		if(!(fp = fopen(paths[i], "rb"))) {
+			printf("could not find '%s'\n", paths[i]);
+			exit(1);
+		}
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		rewind(fp);
+		text = malloc(size + 1);
+		assert(text);
+		text[fread(text, 1, size, fp)] = '\0';
+		fclose(fp);
+		best = 0;
+		for(run = 0; run < 3; run++) {
+			count = wide = 0;
+			t = now();
+			for(pos = text; next_word(&pos, tok.word, sizeof(tok.word)); count++) {
+				for(c = tok.word; *c; c++)
+					if(*c & 0x80) {
+						wide++;
+						break;
+					}
+				make_token(&tok);
+				sink += tok.key;
+			}
+			t = now() - t;
+			if(!run || t < best)
+				best = t;
+		}
+		printf("%-24s  %7.1f MB  %8.2f MB/s  %7.2f Mtokens/s  non-ASCII tokens: %5.1f%%\n",
+			paths[i], size / 1e6, size / best / 1e6, count / best / 1e6,
+			count ? 100.0 * wide / count : 0);
+		free(text);
+	}
+}
+
+// every sentence starting with "dogs" goes on with "bark", though "dogs" is
+// mostly followed by "sleep"
+static const char dogs[] =
+	"Dogs bark loudly. Dogs bark loudly. Dogs bark loudly. "
+	"Big dogs sleep soundly. Big dogs sleep soundly. Big dogs sleep soundly. "
+	"Big dogs sleep soundly. Big dogs sleep soundly.";
+
+/* Function:    text_table()
+ * Description: Build a case folded table from a corpus held in a string.
+ *        Folding stays on, words looked up later must be folded the same.
+ */
+
+static HASH_TABLE *text_table(const char *text) {
+	HASH_TABLE *ht = create_table();
+	FILE	*fp = fmemopen((void *)text, strlen(text), "r");
+
+	assert(fp);
+	set_normalize(NORM_FOLD);
+	insert_words(ht, fp, NULL);
+	fclose(fp);
+	return ht;
+}
+
+/* Function:    check_score()
+ * Description: The second word of a sentence is scored in the context
+ *        (START, first word), so "Dogs bark." beats "Dogs sleep.".  A line
+ *        without a period still scores its end, known last word or not.
+ */
+
+static int check_score() {
+	HASH_TABLE *ht = text_table(dogs);
+	SCORER	*sc = create_scorer(ht);
+	char	bark[] = "Dogs bark.",
+		sleep[] = "Dogs sleep.",
+		open[] = "Dogs bark woof";
+	double	a,
+		b;
+	unsigned words;
+	int	fail = 0;
+
+	a = score_sentence(sc, ht, bark, &words);
+	b = score_sentence(sc, ht, sleep, &words);
+	if(a <= b) {
+		printf("score: 'Dogs bark.' %.3f not above 'Dogs sleep.' %.3f\n", a, b);
+		fail = 1;
+	}
+	score_sentence(sc, ht, open, &words);
+	if(words != 4) {
+		printf("score: 'Dogs bark woof' scored %u events, not 4\n", words);
+		fail = 1;
+	}
+	rem_scorer(sc);
+	clear_table(ht);
+	rem_table(ht);
+	return fail;
+}
+
+/* Function:    same_file()
+ * Description: Do the files at 'a' and 'b' hold the same bytes?
+ */
+
+static int same_file(const char *a, const char *b) {
+	FILE	*fa = fopen(a, "rb"),
+		*fb = fopen(b, "rb");
+	int	ca,
+		cb,
+		same = fa && fb;
+
+	while(same && (ca = getc(fa)) == (cb = getc(fb)) && ca != EOF)
+		;
+	same = same && ca == cb;
+	if(fa)
+		fclose(fa);
+	if(fb)
+		fclose(fb);
+	return same;
+}
+
+/* Function:    count_text()
+ * Description: count_words() on a corpus held in a string into a new file
+ *        in 'dir', whose name is left in 'path'.
+ */
+
+static int count_text(const char *text, size_t len, char *path, size_t memory, const char *dir) {
+	FILE	*fp = fmemopen((void *)text, len, "r");
+	int	fd,
+		ret;
+
+	assert(fp);
+	snprintf(path, 4096, "%s/markov-check-XXXXXX", dir);
+	if((fd = mkstemp(path)) < 0)
+		return -1;
+	close(fd);
+	ret = count_words(fp, path, memory, dir);
+	fclose(fp);
+	return ret;
+}
+
+/* Function:    check_spill()
+ * Description: Count about a million random words out of core, in the
+ *        smallest buffer and with only FD_RESERVE + 8 descriptors allowed.
+ *        That spills some 30 runs, more than can be open at once, so runs
+ *        must be merged while counting.  The model must be the one an
+ *        in-memory count writes.
+ */
+
+static int check_spill() {
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	struct rlimit rl,
+		low;
+	char	in_core[4096],
+		out_core[4096],
+		*text,
+		*p;
+	uint32_t x = 1;
+	unsigned i;
+	int	fail;
+
+	text = malloc(8 << 20);
+	assert(text);
+	for(p = text, i = 0; i < 1000000; i++) {
+		x = x * 1664525 + 1013904223;
+		p += sprintf(p, "w%u%s", (x >> 8) % 20000, (x & 0xff) < 20 ? ". " : " ");
+	}
+	fail = count_text(text, p - text, in_core, 64 << 20, dir) != 0;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	low = rl;
+	low.rlim_cur = FD_RESERVE + 8;
+	setrlimit(RLIMIT_NOFILE, &low);
+	fail |= count_text(text, p - text, out_core, MIN_MEMORY, dir) != 0;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if(fail || !same_file(in_core, out_core)) {
+		printf("spill: a count out of core with few descriptors differs from one in core\n");
+		fail = 1;
+	}
+	unlink(in_core);
+	unlink(out_core);
+	free(text);
+	return fail;
+}
+
+/* Function:    run_checks()
+ * Description: Small fixed corpora whose results are known, for the cases
+ *        the benchmarks would not notice.  Returns the number that failed.
+ */
+
+static int run_checks() {
+	int	failed = 0;
+
+	failed += check_score();
+	failed += check_spill();
+	printf("%s\n", failed ? "checks failed" : "checks passed");
+	return failed;
+}
+
+static void usage() {
+	printf("./bench ingest {text-file} [threads]\n");
+	printf("./bench predict {text-file | model} [queries] [k]\n");
+	printf("./bench generate {text-file | model} [words]\n");
+	printf("./bench abbrev {text-file} [list size]\n");
+	printf("./bench tokenize {text-file} ...\n");
+	printf("./bench check\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	if(argc == 2 && !strcmp(argv[1], "check"))
+		return run_checks() != 0;
+	if(argc < 3)
+		usage();
+	if(!strcmp(argv[1], "ingest"))
+		bench_ingest(argv[2], argc > 3 ? atoi(argv[3]) : 4);
+	else if(!strcmp(argv[1], "predict"))
+		bench_predict(argv[2], argc > 3 ? atoi(argv[3]) : 1000000, argc > 4 ? atoi(argv[4]) : 10);
+	else if(!strcmp(argv[1], "generate"))
+		bench_generate(argv[2], argc > 3 ? atoi(argv[3]) : 10000000);
+	else if(!strcmp(argv[1], "abbrev"))
+		bench_abbrev(argv[2], argc > 3 ? atoi(argv[3]) : 64);
+	else if(!strcmp(argv[1], "tokenize"))
+		bench_tokenize(argv + 2, argc - 2);
+	else
+		usage();
+	return 0;
+}
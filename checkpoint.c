@@ -0,0 +1,390 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+
+/* File:        checkpoint.c
+ * Description: Train with checkpoints so a crashed run can resume.  The
+ *        input is taken an interval at a time; each interval is inserted
+ *        into a table of its own, the delta, which a background thread
+ *        writes out as a segment and then merges into the model while the
+ *        next interval is being inserted.  That is no dearer than inserting
+ *        into the model: the prec and successor lists are scanned linearly,
+ *        and a delta's lists are short, while merge_table() walks the
+ *        model's lists once per distinct edge of the interval rather than
+ *        once per occurrence.
+ *
+ *        path      base snapshot
+ *        path.N    delta segments since the base, N = 1, 2, ...
+ *
+ *        Both are models that load_model() reads, followed by a trailer:
+ *        CKPT_MAGIC, the little-endian u64 input offset they cover up to and
+ *        a u64 FNV-1a hash of the input bytes before that offset, which a
+ *        resumed run checks so it cannot continue on another or an edited
+ *        file.  Files are written under a temporary name, synced, renamed
+ *        and the directory synced, so one either exists whole or not at
+ *        all, and is there before anything depending on it happens.  After
+ *        CKPT_SEGMENTS segments the model becomes the new base and the
+ *        segments are removed; the offsets tell stale segments left by a
+ *        crash in between.
+ */
+
+#define TRAILER_SIZE	(4 + 8 + 8)
+#define FNV_BASIS	14695981039346656037ULL
+
+typedef struct {
+	HASH_TABLE *ht;		// the model, owned by the writer thread
+	const char *path;
+	unsigned segments;	// segments written since the base
+	int	status;		// non-zero once a checkpoint failed
+	HASH_TABLE *delta;	// handed over, NULL once taken
+	uint64_t offset;	// input offset at the end of 'delta'
+	uint64_t hash;		// of the input up to 'offset'
+	unsigned done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} CKPT;
+
+/* Function:    hash_input()
+ * Description: Continue the FNV-1a hash 'h' over 'len' bytes of input.
+ */
+
+static uint64_t hash_input(uint64_t h, const char *buf, size_t len) {
+	while(len--)
+		h = (h ^ (unsigned char)*buf++) * 1099511628211ULL;
+	return h;
+}
+
+/* Function:    put_u64()
+ * Description: Store 'v' little-endian at 'buf'.
+ */
+
+static void put_u64(unsigned char *buf, uint64_t v) {
+	unsigned i;
+
+	for(i = 0; i < 8; i++)
+		buf[i] = v >> (8 * i);
+}
+
+/* Function:    get_u64()
+ * Description: Load a little-endian u64 from 'buf'.
+ */
+
+static uint64_t get_u64(const unsigned char *buf) {
+	uint64_t v = 0;
+	unsigned i;
+
+	for(i = 0; i < 8; i++)
+		v |= (uint64_t)buf[i] << (8 * i);
+	return v;
+}
+
+/* Function:    segment_path()
+ * Description: Name of segment 'n', n = 0 is the base.
+ */
+
+static void segment_path(char *buf, size_t size, const char *path, unsigned n) {
+	if(n)
+		snprintf(buf, size, "%s.%u", path, n);
+	else
+		snprintf(buf, size, "%s", path);
+}
+
+/* Function:    sync_dir()
+ * Description: fsync() the directory holding 'path', so a rename in it
+ *        survives a crash.  Returns non-zero on failure.
+ */
+
+static int sync_dir(const char *path) {
+	char	dir[4096];
+	int	fd,
+		ret;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	if((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+/* Function:    write_checkpoint()
+ * Description: Save 'ht' as segment 'n' covering the input up to
+ *        'offset', whose bytes hash to 'hash'.  Returns non-zero on failure.
+ */
+
+static int write_checkpoint(HASH_TABLE *ht, const char *path, unsigned n, uint64_t offset, uint64_t hash) {
+	char	name[4096],
+		tmp[4096 + 4];
+	unsigned char trailer[TRAILER_SIZE];
+	FILE	*fp;
+	int	ret;
+
+	segment_path(name, sizeof(name), path, n);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	if(save_model(ht, tmp))
+		return -1;
+	memcpy(trailer, CKPT_MAGIC, 4);
+	put_u64(trailer + 4, offset);
+	put_u64(trailer + 12, hash);
+	if(!(fp = fopen(tmp, "ab")))
+		return -1;
+	ret = fwrite(trailer, 1, sizeof(trailer), fp) != sizeof(trailer);
+	ret |= fflush(fp) || fsync(fileno(fp));
+	ret |= fclose(fp);
+	return ret || rename(tmp, name) || sync_dir(name);
+}
+
+/* Function:    read_checkpoint()
+ * Description: Load segment 'n', the offset it covers up to and the hash
+ *        of the input before it.  Returns NULL if it does not exist or is
+ *        damaged.
+ */
+
+static HASH_TABLE *read_checkpoint(const char *path, unsigned n, uint64_t *offset, uint64_t *hash) {
+	char	name[4096];
+	unsigned char trailer[TRAILER_SIZE];
+	HASH_TABLE *ht;
+	FILE	*fp;
+
+	segment_path(name, sizeof(name), path, n);
+	if(!(fp = fopen(name, "rb")))
+		return NULL;
+	if(fseek(fp, -TRAILER_SIZE, SEEK_END) || fread(trailer, 1, sizeof(trailer), fp) != sizeof(trailer)
+	|| memcmp(trailer, CKPT_MAGIC, 4)) {
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	*offset = get_u64(trailer + 4);
+	*hash = get_u64(trailer + 12);
+	if(!(ht = load_model(name)))
+		return NULL;
+	return ht;
+}
+
+/* Function:    remove_segments()
+ * Description: Delete segments 'from' onwards.
+ */
+
+static void remove_segments(const char *path, unsigned from) {
+	char	name[4096];
+
+	for(;; from++) {
+		segment_path(name, sizeof(name), path, from);
+		if(unlink(name) && errno == ENOENT)
+			break;
+	}
+}
+
+/* Function:    resume()
+ * Description: Rebuild the model from the base and the segments after it.
+ *        Sets *offset to where the input continues, *hash to the hash of
+ *        the input before it and *segments to the number of segments kept.
+ *        Returns NULL if the base is damaged.
+ */
+
+static HASH_TABLE *resume(const char *path, uint64_t *offset, uint64_t *hash, unsigned *segments) {
+	HASH_TABLE *ht,
+		*delta;
+	uint64_t end,
+		end_hash;
+	unsigned n;
+	char	name[4096];
+
+	*offset = 0;
+	*hash = FNV_BASIS;
+	*segments = 0;
+	segment_path(name, sizeof(name), path, 0);
+	if(access(name, F_OK) == 0) {
+		if(!(ht = read_checkpoint(path, 0, offset, hash)))
+			return NULL;
+	}
+	else
+		ht = create_table();
+	for(n = 1; (delta = read_checkpoint(path, n, &end, &end_hash)); n++) {
+		// left behind by a crash while the base was being replaced
+		if(end <= *offset) {
+			clear_table(delta);
+			rem_table(delta);
+			break;
+		}
+		merge_table(ht, delta);
+		clear_table(delta);
+		rem_table(delta);
+		*offset = end;
+		*hash = end_hash;
+		*segments = n;
+	}
+	remove_segments(path, *segments + 1);
+	return ht;
+}
+
+/* Function:    writer()
+ * Description: Body of the writer thread: write each delta handed over as
+ *        the next segment, merge it into the model, and replace the base
+ *        every CKPT_SEGMENTS segments.
+ */
+
+static void *writer(void *arg) {
+	CKPT	*ck = arg;
+	HASH_TABLE *delta;
+	uint64_t offset,
+		hash;
+
+	for(;;) {
+		pthread_mutex_lock(&ck->lock);
+		while(!ck->delta && !ck->done)
+			pthread_cond_wait(&ck->cond, &ck->lock);
+		delta = ck->delta;
+		offset = ck->offset;
+		hash = ck->hash;
+		ck->delta = NULL;
+		pthread_cond_signal(&ck->cond);
+		pthread_mutex_unlock(&ck->lock);
+		if(!delta)
+			break;
+
+		if(!ck->status)
+			ck->status = write_checkpoint(delta, ck->path, ck->segments + 1, offset, hash);
+		merge_table(ck->ht, delta);
+		clear_table(delta);
+		rem_table(delta);
+		if(!ck->status && ++ck->segments == CKPT_SEGMENTS) {
+			ck->status = write_checkpoint(ck->ht, ck->path, 0, offset, hash);
+			remove_segments(ck->path, 1);
+			ck->segments = 0;
+		}
+	}
+	return NULL;
+}
+
+/* Function:    hand_over()
+ * Description: Give the writer a delta, waiting while it still has the
+ *        previous one.  NULL tells it to finish.
+ */
+
+static void hand_over(CKPT *ck, HASH_TABLE *delta, uint64_t offset, uint64_t hash) {
+	pthread_mutex_lock(&ck->lock);
+	while(ck->delta)
+		pthread_cond_wait(&ck->cond, &ck->lock);
+	ck->delta = delta;
+	ck->offset = offset;
+	ck->hash = hash;
+	ck->done = !delta;
+	pthread_cond_signal(&ck->cond);
+	pthread_mutex_unlock(&ck->lock);
+}
+
+/* Function:    skip_input()
+ * Description: Read 'fp' past the first 'offset' bytes, which must hash to
+ *        'hash'.  They are read rather than seeked over so that a shorter,
+ *        different or edited input is caught.  Returns non-zero and says
+ *        why if the input does not fit the checkpoint.
+ */
+
+static int skip_input(FILE *fp, uint64_t offset, uint64_t hash) {
+	char	buf[1 << 16];
+	uint64_t h = FNV_BASIS,
+		left = offset;
+	size_t	n;
+
+	while(left) {
+		n = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), fp);
+		if(!n) {
+			fprintf(stderr, "the input is shorter than the %llu bytes checkpointed\n",
+				(unsigned long long)offset);
+			return -1;
+		}
+		h = hash_input(h, buf, n);
+		left -= n;
+	}
+	if(h != hash) {
+		fprintf(stderr, "the input differs from the one checkpointed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Function:    checkpoint_words()
+ * Description: Build the table from 'fp' like insert_words(), checkpointing
+ *        to 'path' every 'interval' bytes of input, and resuming from the
+ *        checkpoint already at 'path' if there is one.  read_block() cuts
+ *        the intervals only after words parse() ends a sentence with, so
+ *        the merged counts match a plain run, save that an interval with no
+ *        sentence end in it is cut at its last space and that single-quoted
+ *        speech running over a cut is not told from apostrophes.  With more
+ *        than one thread each interval goes through insert_words_mt().
+ *        Returns NULL if the checkpoint cannot be read or does not fit the
+ *        input or the normalization flags; a checkpoint that cannot be
+ *        written is reported and training goes on.
+ */
+
+HASH_TABLE *checkpoint_words(FILE *fp, const char *path, size_t interval, unsigned threads) {
+	CKPT	ck = {0};
+	BLOCK	*blk;
+	HASH_TABLE *delta;
+	FILE	*mem;
+	pthread_t tid;
+	uint64_t offset,
+		pos,
+		hash;
+	size_t	carry,
+		covered;
+	unsigned norm = get_normalize();
+
+	assert(fp && path);
+	if(!(ck.ht = resume(path, &offset, &hash, &ck.segments)))
+		return NULL;
+	// load_model() took the checkpoint's flags over those asked for
+	if(get_normalize() != norm) {
+		fprintf(stderr, "'%s' was trained with other -f, -a or -y flags\n", path);
+		set_normalize(norm);
+		clear_table(ck.ht);
+		rem_table(ck.ht);
+		return NULL;
+	}
+	if(skip_input(fp, offset, hash)) {
+		clear_table(ck.ht);
+		rem_table(ck.ht);
+		return NULL;
+	}
+	ck.path = path;
+	pthread_mutex_init(&ck.lock, NULL);
+	pthread_cond_init(&ck.cond, NULL);
+	pthread_create(&tid, NULL, writer, &ck);
+
+	blk = create_block(interval);
+	pos = offset;
+	for(;;) {
+		carry = blk->size > blk->len ? blk->size - blk->len - 1 : 0;
+		if(!read_block(fp, blk, blk))
+			break;
+		pos += blk->size - carry;
+		delta = create_table();
+		mem = fmemopen(blk->data, blk->len, "r");
+		assert(mem);
+		if(threads > 1)
+			insert_words_mt(delta, mem, threads, INS_ATOMIC);
+		else
+			insert_words(delta, mem, NULL);
+		fclose(mem);
+		// the text carried over to the next interval is not covered yet,
+		// the whitespace cut at data[len] is
+		covered = blk->size > blk->len ? blk->len + 1 : blk->size;
+		hash = hash_input(hash, blk->data, blk->len);
+		if(covered > blk->len)
+			hash = hash_input(hash, &blk->cut, 1);
+		hand_over(&ck, delta, pos - (blk->size - covered), hash);
+	}
+	hand_over(&ck, NULL, 0, 0);
+	pthread_join(tid, NULL);
+	rem_block(blk);
+	pthread_mutex_destroy(&ck.lock);
+	pthread_cond_destroy(&ck.cond);
+	if(ck.status)
+		fprintf(stderr, "could not write checkpoint '%s', training went on without\n", path);
+	return ck.ht;
+}
@@ -0,0 +1,13 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "model.h"
+#include "ingest.h"
+
+#define CKPT_MAGIC	"MKVC"
+#define CKPT_INTERVAL	(64 << 20)	// input bytes between checkpoints
+#define CKPT_SEGMENTS	8		// delta segments kept before a new base
+
+HASH_TABLE *checkpoint_words(FILE *, const char *, size_t, unsigned);
+
+#endif /* CHECKPOINT_H */
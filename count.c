@@ -0,0 +1,413 @@
+#include "count.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* File:        count.c
+ * Description: Train a model too large for memory.  Only the vocabulary
+ *        is kept as a table (nodes without edges); every edge insert_node()
+ *        would have made is written as a (context, successor) TUPLE into a
+ *        bounded buffer.  A full buffer is sorted and summed, and spilled as
+ *        a run file once summing no longer frees half of it.  Runs are
+ *        merged k ways a level at a time while counting, so only a bounded
+ *        number are ever open, and at the end the rest are merged, summing
+ *        equal edges again, straight into the model file.  All run I/O goes
+ *        through slices of the tuple buffer, which stays the only memory
+ *        counted against the budget.
+ */
+
+typedef struct {
+	int	fd;
+	unsigned level;		// merges it went through
+} RUN;
+
+typedef struct {
+	TUPLE	*buf;
+	size_t	n;
+	size_t	cap;
+	RUN	*runs;		// sorted runs spilled so far, oldest first
+	unsigned nruns;
+	unsigned fan;		// runs merged into one in a pass
+	unsigned max_runs;	// runs open at once before all are merged
+	const char *tmpdir;
+} SPILL;
+
+typedef struct {
+	TUPLE	t;		// next tuple of the run
+	int	fd;
+	TUPLE	*buf;		// read ahead, a slice of the tuple buffer
+	size_t	n;
+	size_t	pos;
+	size_t	cap;
+} HEAD;
+
+typedef struct {
+	int	fd;
+	TUPLE	*buf;		// a slice of the tuple buffer
+	size_t	n;
+	size_t	cap;
+} OUT;
+
+typedef void (*EMIT)(void *, TUPLE *);
+
+/* Function:    aggregate()
+ * Description: Sort 'n' tuples and sum the counts of equal ones, returns
+ *        the number of distinct tuples left at the front.
+ */
+
+static size_t aggregate(TUPLE *t, size_t n) {
+	size_t	i,
+		j = 0;
+
+	if(!n)
+		return 0;
+	qsort(t, n, sizeof(*t), tuple_cmp);
+	for(i = 1; i < n; i++) {
+		if(!tuple_cmp(&t[i], &t[j]))
+			t[j].count += t[i].count;
+		else
+			t[++j] = t[i];
+	}
+	return j + 1;
+}
+
+/* Function:    open_run()
+ * Description: Create an anonymous run file in the spill directory, it is
+ *        unlinked right away so nothing is left behind after a crash.
+ */
+
+static int open_run(const char *dir) {
+	char	path[4096];
+	int	fd;
+
+	snprintf(path, sizeof(path), "%s/markov-XXXXXX", dir);
+	if((fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "could not create a run in '%s': %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	unlink(path);
+	return fd;
+}
+
+/* Function:    write_tuples()
+ * Description: Append 'n' tuples to a run file.
+ */
+
+static void write_tuples(int fd, TUPLE *t, size_t n) {
+	const char *p = (const char *)t;
+	size_t	left = n * sizeof(*t);
+	ssize_t	done;
+
+	while(left) {
+		if((done = write(fd, p, left)) < 0) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "could not write a run: %s\n", strerror(errno));
+			exit(1);
+		}
+		p += done;
+		left -= done;
+	}
+}
+
+/* Function:    write_run()
+ * Description: EMIT function appending to a run file through an OUT
+ *        buffer.
+ */
+
+static void write_run(void *arg, TUPLE *t) {
+	OUT	*out = arg;
+
+	if(out->n == out->cap) {
+		write_tuples(out->fd, out->buf, out->n);
+		out->n = 0;
+	}
+	out->buf[out->n++] = *t;
+}
+
+/* Function:    emit_edge()
+ * Description: EMIT function writing into the model.
+ */
+
+static void emit_edge(void *m, TUPLE *t) {
+	write_edge(m, t);
+}
+
+/* Function:    next_tuple()
+ * Description: Read the next tuple of a run into h->t, refilling the slice
+ *        when it runs dry.  Returns 0 at the end of the run.
+ */
+
+static int next_tuple(HEAD *h) {
+	ssize_t	got;
+	size_t	bytes;
+
+	if(h->pos == h->n) {
+		for(bytes = 0; bytes < h->cap * sizeof(TUPLE); bytes += got) {
+			got = read(h->fd, (char *)h->buf + bytes, h->cap * sizeof(TUPLE) - bytes);
+			if(got < 0 && errno == EINTR)
+				got = 0;
+			else if(got < 0) {
+				fprintf(stderr, "could not read a run: %s\n", strerror(errno));
+				exit(1);
+			}
+			else if(!got)
+				break;
+		}
+		h->n = bytes / sizeof(TUPLE);
+		h->pos = 0;
+		if(!h->n)
+			return 0;
+	}
+	h->t = h->buf[h->pos++];
+	return 1;
+}
+
+/* Function:    add_run()
+ * Description: Keep a run for merging, rewound for reading.
+ */
+
+static void add_run(SPILL *sp, int fd, unsigned level) {
+	lseek(fd, 0, SEEK_SET);
+	sp->runs = realloc(sp->runs, (sp->nruns + 1) * sizeof(*sp->runs));
+	assert(sp->runs);
+	sp->runs[sp->nruns].fd = fd;
+	sp->runs[sp->nruns++].level = level;
+}
+
+/* Function:    sift()
+ * Description: Restore the min-heap order of 'heap' below slot i.
+ */
+
+static void sift(HEAD *heap, unsigned n, unsigned i) {
+	HEAD	t;
+	unsigned c;
+
+	while((c = 2 * i + 1) < n) {
+		if(c + 1 < n && tuple_cmp(&heap[c + 1].t, &heap[c].t) < 0)
+			c++;
+		if(tuple_cmp(&heap[c].t, &heap[i].t) >= 0)
+			break;
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+		i = c;
+	}
+}
+
+/* Function:    merge()
+ * Description: Merge the 'n' sorted runs from runs[first] on, summing equal
+ *        tuples, and hand the result to 'emit' in order.  The runs read
+ *        ahead into 'n' slices of 'slice' tuples of the buffer, which must
+ *        be empty.  The runs are closed and dropped.
+ */
+
+static void merge(SPILL *sp, unsigned first, size_t slice, EMIT emit, void *arg) {
+	unsigned n = sp->nruns - first;
+	HEAD	heap[n];
+	TUPLE	cur;
+	unsigned i,
+		size = 0,
+		have = 0;
+
+	for(i = 0; i < n; i++) {
+		heap[size] = (HEAD){.fd = sp->runs[first + i].fd, .buf = sp->buf + i * slice, .cap = slice};
+		if(next_tuple(&heap[size]))
+			size++;
+		else
+			close(heap[size].fd);
+	}
+	for(i = size; i-- > 0; )
+		sift(heap, size, i);
+	while(size) {
+		if(have && !tuple_cmp(&heap[0].t, &cur))
+			cur.count += heap[0].t.count;
+		else {
+			if(have)
+				emit(arg, &cur);
+			cur = heap[0].t;
+			have = 1;
+		}
+		if(!next_tuple(&heap[0])) {
+			close(heap[0].fd);
+			heap[0] = heap[--size];
+		}
+		sift(heap, size, 0);
+	}
+	if(have)
+		emit(arg, &cur);
+	sp->nruns = first;
+}
+
+/* Function:    merge_runs()
+ * Description: Merge the runs from runs[first] on into one run a level
+ *        above the highest of them, through the empty buffer.
+ */
+
+static void merge_runs(SPILL *sp, unsigned first) {
+	unsigned n = sp->nruns - first,
+		level = 0,
+		i;
+	size_t	slice = sp->cap / (n + 1);
+	OUT	out = {open_run(sp->tmpdir), sp->buf + n * slice, 0, sp->cap - n * slice};
+
+	for(i = first; i < sp->nruns; i++)
+		if(sp->runs[i].level > level)
+			level = sp->runs[i].level;
+	merge(sp, first, slice, write_run, &out);
+	write_tuples(out.fd, out.buf, out.n);
+	add_run(sp, out.fd, level + 1);
+}
+
+/* Function:    compact()
+ * Description: Keep the number of open runs bounded while counting: 'fan'
+ *        runs of one level are merged into one of the next, and once
+ *        'max_runs' are open regardless of level all of them are.  Each
+ *        tuple is then rewritten about once per level.
+ */
+
+static void compact(SPILL *sp) {
+	unsigned k;
+
+	for(;;) {
+		for(k = 1; k < sp->nruns && sp->runs[sp->nruns - k - 1].level == sp->runs[sp->nruns - 1].level; k++)
+			;
+		if(k >= sp->fan)
+			merge_runs(sp, sp->nruns - sp->fan);
+		else if(sp->nruns >= sp->max_runs)
+			merge_runs(sp, 0);
+		else
+			break;
+	}
+}
+
+/* Function:    flush()
+ * Description: Make room in the buffer: sum it, and if that leaves it more
+ *        than half full (or 'force' is set) spill it as a new run.
+ */
+
+static void flush(SPILL *sp, unsigned force) {
+	int	fd;
+
+	sp->n = aggregate(sp->buf, sp->n);
+	if(!sp->n || (!force && sp->n < sp->cap / 2))
+		return;
+	fd = open_run(sp->tmpdir);
+	write_tuples(fd, sp->buf, sp->n);
+	add_run(sp, fd, 0);
+	sp->n = 0;
+	compact(sp);
+}
+
+/* Function:    add_tuple()
+ * Description: Count one occurrence of the edge (a, b, c).
+ */
+
+static void add_tuple(SPILL *sp, uint32_t a, uint32_t b, uint32_t c) {
+	if(sp->n == sp->cap)
+		flush(sp, 0);
+	sp->buf[sp->n++] = (TUPLE){a, b, c, 1};
+}
+
+/* Function:    set_fan()
+ * Description: Size the merges to the file descriptors this process may
+ *        open: MAX_RUNS runs per pass, fewer when the limit is low, and
+ *        all runs merged into one before they would run out.
+ */
+
+static void set_fan(SPILL *sp) {
+	struct rlimit rl;
+	rlim_t	avail = 4 * MAX_RUNS + 1;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY \
+	&& rl.rlim_cur < FD_RESERVE + avail)
+		avail = rl.rlim_cur > FD_RESERVE + 3 ? rl.rlim_cur - FD_RESERVE : 3;
+	// one more is opened for the output of a merge
+	sp->max_runs = avail - 1;
+	sp->fan = sp->max_runs / 4 < MAX_RUNS ? sp->max_runs / 4 : MAX_RUNS;
+	if(sp->fan < 2)
+		sp->fan = 2;
+}
+
+/* Function:    count_words()
+ * Description: Count the corpus in 'fp' within about 'memory' bytes (on
+ *        top of the vocabulary) and write the model to 'path', spilling runs
+ *        into 'tmpdir'.  Returns non-zero if the model could not be written.
+ */
+
+int count_words(FILE *fp, const char *path, size_t memory, const char *tmpdir) {
+	HASH_TABLE *ht = create_table();
+	BLOCK	*blk = create_block(BLOCK_SIZE);
+	SPILL	sp = {0};
+	TOKEN	tok;
+	NODE	*node,
+		*prev = NULL,
+		*prev2 = NULL,
+		**words;
+	MODEL	*m;
+	char	*pos;
+	unsigned nwords = 0,
+		prev_was_first = 0;
+	size_t	i;
+	int	ret;
+
+	sp.tmpdir = tmpdir;
+	set_fan(&sp);
+	sp.cap = (memory < MIN_MEMORY ? MIN_MEMORY : memory) / sizeof(TUPLE);
+	sp.buf = malloc(sp.cap * sizeof(TUPLE));
+	assert(sp.buf);
+
+	// the same edges, in the same cases, as insert_node()
+	while(read_block(fp, blk, blk)) {
+		pos = blk->data;
+		reset_parse();
+		while(next_word(&pos, tok.word, sizeof(tok.word))) {
+			make_token(&tok);
+			node = count_token(ht, &tok, !prev);
+			if(node->freq == 1)
+				node->id = nwords++;
+			if(prev) {
+				add_tuple(&sp, prev->id, node->id, EDGE_PREC);
+				if(prev_was_first)
+					add_tuple(&sp, prev->id, node->id, EDGE_START);
+				if(prev2)
+					add_tuple(&sp, prev2->id, prev->id, EDGE_SUCC + node->id);
+			}
+			prev_was_first = !prev;
+			prev2 = prev;
+			prev = node;
+			if(tok.is_last)
+				prev = prev2 = NULL;
+		}
+	}
+	rem_block(blk);
+
+	words = malloc(nwords * sizeof(*words) + 1);
+	assert(words);
+	while((node = get_next_node(ht)))
+		words[node->id] = node;
+	if(!(m = create_model(path, ht, words, nwords))) {
+		fprintf(stderr, "could not create '%s'\n", path);
+		exit(1);
+	}
+	if(!sp.nruns) {
+		// everything fit, no need to go through the disk
+		sp.n = aggregate(sp.buf, sp.n);
+		for(i = 0; i < sp.n; i++)
+			write_edge(m, &sp.buf[i]);
+	}
+	else {
+		// compact() has kept the runs few enough to all be open at once
+		flush(&sp, 1);
+		merge(&sp, 0, sp.cap / sp.nruns, emit_edge, m);
+	}
+	ret = close_model(m);
+
+	free(sp.buf);
+	free(sp.runs);
+	free(words);
+	clear_table(ht);
+	rem_table(ht);
+	return ret;
+}
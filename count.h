@@ -0,0 +1,13 @@
+#ifndef COUNT_H
+#define COUNT_H
+
+#include "model.h"
+#include "ingest.h"
+
+#define MAX_RUNS	64		// most runs merged in one pass
+#define MIN_MEMORY	(1 << 20)	// smallest tuple buffer
+#define FD_RESERVE	16		// descriptors left for everything but runs
+
+int count_words(FILE *, const char *, size_t, const char *);
+
+#endif /* COUNT_H */
@@ -0,0 +1,227 @@
+#include "gen.h"
+
+#include <stdint.h>
+#include <math.h>
+
+/* File:        gen.c
+ * Description: Sentence generation as an iterator.  markov_next_token()
+ *        yields one word at a time, with the punctuation to write around
+ *        it, and keeps everything it needs in the GENERATOR, so a caller
+ *        can stop whenever it likes and any number of generators can share
+ *        one predictor and run interleaved on a thread.  Sentences follow
+ *        each other for as long as tokens are asked for.
+ *
+ *        A sentence can also be grown from a keyword: seed_generator() walks
+ *        backwards from it to a sentence start, and the iterator yields
+ *        that half before carrying on forwards from the keyword.
+ */
+
+/* Function:    gen_rand()
+ * Description: Uniform draw on [0, 1) from the generator's stream.
+ */
+
+static double gen_rand(GENERATOR *gen) {
+	return ldexp(pcg32_random_r(&gen->rng), -32);
+}
+
+/* Function:    create_generator()
+ * Description: Start a generator over 'pd' with its own random stream.
+ */
+
+GENERATOR *create_generator(PREDICTOR *pd, uint64_t seed) {
+	GENERATOR *gen = calloc(1, sizeof(*gen));
+
+	assert(gen && pd);
+	gen->pd = pd;
+	pcg32_srandom_r(&gen->rng, seed, (intptr_t)gen);
+	return gen;
+}
+
+/* Function:    rem_generator()
+ * Description: Free a generator, the predictor is untouched.
+ */
+
+void rem_generator(GENERATOR *gen) {
+	free(gen);
+}
+
+/* Function:    next_node()
+ * Description: Pick the word after the last one, or the first word of a
+ *        sentence, unless seeded words are waiting.  When the last two
+ *        words were never followed by anything, back off to the words seen
+ *        after the last one and then to the words that start sentences,
+ *        counting each time it happens.
+ */
+
+static NODE *next_node(GENERATOR *gen) {
+	PREDICTOR *pd = gen->pd;
+	CONTEXT	*ctx;
+
+	if(gen->queued)
+		return gen->queue[--gen->queued];
+	if(!gen->node)
+		return sample(find_context(pd, CTX_START, NULL), gen_rand(gen));
+	gen->picks++;
+	if(!(ctx = find_context(pd, gen->prev, gen->node))) {
+		gen->backoffs++;
+		if(!(ctx = find_context(pd, NULL, gen->node)))
+			ctx = find_context(pd, CTX_START, NULL);
+	}
+	return sample(ctx, gen_rand(gen));
+}
+
+/* Function:    seed_generator()
+ * Description: Make the next sentence contain 'keyword'.  Starting from it,
+ *        sample the word before from the backward index 'back' (see
+ *        create_backward()), given the two words after it, until a sentence
+ *        start is drawn or GEN_SEED_MAX words are queued.  Contexts seen
+ *        only once back off like next_node() does, and are counted with its
+ *        picks and backoffs.  A sentence in progress is dropped.  Returns
+ *        the number of words queued, 0 if the keyword is not in the index.
+ */
+
+int seed_generator(GENERATOR *gen, PREDICTOR *back, NODE *keyword) {
+	CONTEXT	*ctx;
+	NODE	*a,
+		*b = keyword,
+		*c = NULL;
+
+	gen->node = NULL;
+	gen->quoted = gen->comma = gen->closing = 0;
+	gen->queued = 0;
+	if(!keyword || !find_context(back, NULL, keyword))
+		return 0;
+	gen->queue[gen->queued++] = keyword;
+	while(gen->queued < GEN_SEED_MAX) {
+		ctx = NULL;
+		if(c) {
+			gen->picks++;
+			if(!(ctx = find_context(back, b, c)))
+				gen->backoffs++;
+		}
+		if(!ctx)
+			ctx = find_context(back, NULL, b);
+		a = sample(ctx, gen_rand(gen));
+		if(!a || a == CTX_START)
+			break;
+		gen->queue[gen->queued++] = a;
+		c = b;
+		b = a;
+	}
+	return gen->queued;
+}
+
+/* Function:    add_end()
+ * Description: End the sentence after the token, picking '.', '?', '!' or an
+ *        ellipsis in proportion to how the word ended sentences in the
+ *        corpus.  'd' is a uniform draw on [0, 1).
+ */
+
+static void add_end(GENERATOR *gen, GEN_TOKEN *tok, double d) {
+	PUNC	*p = &tok->node->punc;
+	unsigned total = p->period + p->question + p->bang + p->end_ellipsis;
+
+	d *= total;
+	if(d < p->question)
+		strcat(tok->after, "?");
+	else if(d < p->question + p->bang)
+		strcat(tok->after, "!");
+	else if(d < p->question + p->bang + p->end_ellipsis)
+		strcat(tok->after, "...");
+	else
+		strcat(tok->after, ".");
+	if(gen->quoted || gen->closing)
+		strcat(tok->after, "\"");
+	gen->quoted = gen->comma = gen->closing = 0;
+	tok->last = 1;
+}
+
+/* Function:    markov_next_token()
+ * Description: Generate the next word into 'tok'.  An opening quote, a
+ *        closing quote and a trailing comma each get their own draw against
+ *        the node's inline PUNC counts; trailing marks are held back in the
+ *        generator until the next word, the sentence may end here.
+ *        Titles such as "Mr." keep their period.  The sentence then ends
+ *        with probability last / freq.  Returns 0 only if the model has no
+ *        sentences to start.
+ */
+
+int markov_next_token(GENERATOR *gen, GEN_TOKEN *tok) {
+	NODE	*node = next_node(gen);
+	PUNC	*p;
+	unsigned total,
+		i = 0;
+	double	d;
+
+	if(!node)
+		return 0;
+	tok->node = node;
+	tok->word = node->word;
+	tok->first = !gen->node;
+	tok->last = 0;
+	gen->prev = gen->node ? gen->node : CTX_START;
+	gen->node = node;
+
+	// one of these four is counted per occurrence of the word
+	p = &node->punc;
+	total = p->nothing + p->comma + p->question + p->bang;
+	if(gen->comma)
+		tok->before[i++] = ',';
+	if(gen->closing)
+		tok->before[i++] = '"';
+	gen->comma = gen->closing = 0;
+	if(!tok->first)
+		tok->before[i++] = ' ';
+	if(!gen->quoted && p->beg_quotes && gen_rand(gen) * total < p->beg_quotes) {
+		tok->before[i++] = '"';
+		gen->quoted = 1;
+	}
+	tok->before[i] = '\0';
+	if(gen->quoted && p->end_quotes && gen_rand(gen) * total < p->end_quotes) {
+		gen->quoted = 0;
+		gen->closing = 1;
+	}
+	if(p->comma && gen_rand(gen) * total < p->comma)
+		gen->comma = 1;
+	strcpy(tok->after, p->prefix * 2 > total ? "." : "");
+
+	// a seeded sentence goes on at least to its keyword
+	if(node->last && !gen->queued) {
+		d = gen_rand(gen) * node->freq;
+		if(d < node->last) {
+			// d / last is again uniform on [0, 1), reuse it
+			add_end(gen, tok, d / node->last);
+			gen->node = NULL;
+		}
+	}
+	return 1;
+}
+
+/* Function:    format_token()
+ * Description: Write the token as it should appear, the case it was most
+ *        often seen in and its punctuation, into 'buf'.
+ */
+
+char *format_token(GEN_TOKEN *tok, char *buf, size_t size) {
+	char	word[64];
+
+	strcpy(word, tok->word);
+	apply_shape(word, tok->node->shape);
+	if(tok->first)
+		capitalize(word);
+	snprintf(buf, size, "%s%s%s", tok->before, word, tok->after);
+	return buf;
+}
+
+/* Function:    print_token()
+ * Description: Print the token, with a newline after the last of a
+ *        sentence.
+ */
+
+void print_token(GEN_TOKEN *tok, FILE *fp) {
+	char	buf[80];
+
+	fputs(format_token(tok, buf, sizeof(buf)), fp);
+	if(tok->last)
+		putc('\n', fp);
+}
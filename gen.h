@@ -0,0 +1,39 @@
+#ifndef GEN_H
+#define GEN_H
+
+#include "predict.h"
+#include "pcg-c-basic-0.9/pcg_basic.h"
+
+#define GEN_SEED_MAX	64	// longest left half of a seeded sentence
+
+typedef struct {
+	NODE	*node;		// the word, node->id is its frequency rank
+	const char *word;	// node->word, the normalized spelling, not a copy
+	unsigned first;		// starts a sentence
+	unsigned last;		// ends a sentence
+	char	before[5];	// marks held back from the previous word, space, opening quote
+	char	after[6];	// a title's period, at the end the end mark and closing quote
+} GEN_TOKEN;			// one generated word, see markov_next_token()
+
+typedef struct {
+	PREDICTOR *pd;		// shared, only read
+	pcg32_random_t rng;
+	NODE	*prev;		// two words back, CTX_START after the first word
+	NODE	*node;		// last word, NULL between sentences
+	unsigned quoted;	// a quote has been opened in this sentence
+	unsigned comma;		// last word is followed by a comma
+	unsigned closing;	// last word closes the quote
+	unsigned picks;		// words picked with a two word context, seeding too
+	unsigned backoffs;	// picks whose two word context was a dead end
+	NODE	*queue[GEN_SEED_MAX];	// seeded words, right to left
+	unsigned queued;	// still to be yielded, from queue[queued - 1] down
+} GENERATOR;			// all the state of one stream of sentences
+
+GENERATOR *create_generator(PREDICTOR *, uint64_t);
+void rem_generator(GENERATOR *);
+int seed_generator(GENERATOR *, PREDICTOR *, NODE *);
+int markov_next_token(GENERATOR *, GEN_TOKEN *);
+char *format_token(GEN_TOKEN *, char *, size_t);
+void print_token(GEN_TOKEN *, FILE *);
+
+#endif /* GEN_H */
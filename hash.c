@@ -12,12 +12,17 @@
 
 static unsigned gen_hash(char *);
 static NODE *create_node(unsigned, char *, unsigned, unsigned);
-static NODE *insert_node(HASH_TABLE *, unsigned, char *, NODE *, unsigned);
+static NODE *insert_node(HASH_TABLE *, CURSOR *, unsigned, char *, unsigned);
+static NODE *insert_node_atomic(HASH_TABLE *, CURSOR *, unsigned, char *, unsigned);
 static void rem_node(NODE *);
+static void rem_succs(SUCC *);
 static SUCC *add_succ(SUCC *, NODE *); 
 static void print_nodes_in_bucket(NODE *);
 static PREC *add_prec(NODE *, PREC *);
 static SUCC *find_succ(NODE *, SUCC *);
+static NODE *find_or_add_node(HASH_TABLE *, unsigned, char *, unsigned, unsigned);
+static PREC *find_or_add_prec(NODE *, NODE *);
+static void find_or_add_succ(SUCC **, NODE *, unsigned *);
 
 /* Function:    gen_hash()
  * Description: Generate 16-bit hash value for a given input string.
@@ -42,11 +47,9 @@ static unsigned gen_hash(char *s) {
  */
 
 HASH_TABLE *create_table() {
-    HASH_TABLE *ht = malloc(sizeof(HASH_TABLE));
+    HASH_TABLE *ht = calloc(1, sizeof(HASH_TABLE));
     assert(ht);
     
-    ht->count = 0;
-    ht->sentences = 0;
     return ht;
 }
     
@@ -60,7 +63,7 @@ HASH_TABLE *clear_table(HASH_TABLE *ht) {
     NODE    *curr,
         *prev;
 
-    for(i = 0; i < USHRT_MAX; i++) {
+    for(i = 0; i < BUCKETS; i++) {
         curr = ht->bucket[i];
         while(curr) {
             prev = curr;
@@ -74,32 +77,38 @@ HASH_TABLE *clear_table(HASH_TABLE *ht) {
     return ht;
 }
 
+/* Function:     rem_succs()
+ * Description:  Free a list of successors.
+ */
+
+static void rem_succs(SUCC *curr_s) {
+    SUCC    *prev_s;
+
+    while(curr_s) {
+        prev_s = curr_s;
+        curr_s = curr_s->next;
+        free(prev_s);
+    }
+}
+
 /* Function:     rem_node() 
- * Description:  Remove node, free 'node' and all elements in 'succ.'
+ * Description:  Remove node, free 'node', its precs with their successors
+ *        and the start successors in 'succ.'
  */
 
 void rem_node(NODE *node) {
     PREC     *curr_p = node->prec,
         *prev_p = NULL;
-    SUCC    *curr_s,
-        *prev_s = NULL;
 
     while(curr_p) {
-        curr_s = curr_p->succ;
-        while(curr_s) {
-            prev_s = curr_s;
-            curr_s = curr_s->next;
-            free(prev_s);
-        }
+        rem_succs(curr_p->succ);
         prev_p = curr_p;
         curr_p = curr_p->next;
         free(prev_p);
     }
-    printf("key '%u', freeing '%s'\n", node->key, node->word);
+    rem_succs(node->succ);
     free(node->word);
-    free(node->punc);
     free(node);
-    node = NULL;
 }
 
 /* Function:     rem_table()
@@ -107,18 +116,25 @@ void rem_node(NODE *node) {
  */
 
 void rem_table(HASH_TABLE *ht) {
+    unsigned i;
+
+    if(ht->locks) {
+        for(i = 0; i < BUCKETS; i++)
+            pthread_mutex_destroy(&ht->locks[i]);
+        free(ht->locks);
+    }
     free(ht);
 }
 
 /* Function:     insert_node()
- * Description:  Inserts the key/word pair into the hash table and returns the current node
- *        to use as next function call's prev_node
+ * Description:  Inserts the key/word pair into the hash table and returns the current node.
+ *        'cur' carries the previous word and its edge between calls, one
+ *        cursor per stream of words being inserted.
  */
 // TODO: split into multiple functions, currently is cumbersome pos
 
-static NODE *insert_node(HASH_TABLE *ht, unsigned key, char *word, NODE *prev_node, unsigned is_last) {
-    static PREC *prev_prec = NULL;
-    static unsigned prev_was_first = 0;
+static NODE *insert_node(HASH_TABLE *ht, CURSOR *cur, unsigned key, char *word, unsigned is_last) {
+    NODE    *prev_node = cur->prev;
     PREC    *temp;
     NODE    *node,
             *prev = NULL;
@@ -165,10 +181,13 @@ static NODE *insert_node(HASH_TABLE *ht, unsigned key, char *word, NODE *prev_no
             node->prec = add_prec(prev_node, node->prec);
             node->sum_prec++;
         }
+        else {
+            temp->freq++;
+        }
         node->num_prec++;
 
         // check if prev word was first in sentence, if so then add to list of succ for prev_node
-        if(prev_was_first) {
+        if(cur->prev_was_first) {
             SUCC    *succ = find_succ(node, prev_node->succ);
 
             if(succ) {
@@ -178,37 +197,171 @@ static NODE *insert_node(HASH_TABLE *ht, unsigned key, char *word, NODE *prev_no
                 prev_node->succ = add_succ(prev_node->succ, node);
                 prev_node->num_succ++;
             }
-            prev_was_first = 0;
+            cur->prev_was_first = 0;
             prev_node->sum_succ++;
         }
     }
     else {
-        ht->sentences++;
-        prev_was_first = 1;
+        // the totals are shared by every cursor, see insert_token()
+        __atomic_fetch_add(&ht->sentences, 1, __ATOMIC_RELAXED);
+        cur->prev_was_first = 1;
     }
 
     // SUCC INSERTION
     // prev_prec shold be equal to head of the previous-prev_node's prec list
-    if(prev_prec) {
-        SUCC    *curr = find_succ(node, prev_prec->succ);
+    if(cur->prev_prec) {
+        SUCC    *curr = find_succ(node, cur->prev_prec->succ);
 
         if(curr) {
             curr->freq++;
         }
         else {
-            prev_prec->succ = add_succ(prev_prec->succ, node);
-            prev_prec->num_succ++;
+            cur->prev_prec->succ = add_succ(cur->prev_prec->succ, node);
+            cur->prev_prec->num_succ++;
         }
-        prev_prec->sum_succ++;
+        cur->prev_prec->sum_succ++;
     }
     // set new prec pointer if prev_node exists, must come after setting prev_prec's succ
     if(prev_node) {
-        prev_prec = find_prec(prev_node, node);
+        cur->prev_prec = find_prec(prev_node, node);
     }
     // if last word in sentence, reset prev pointer, there is no preceeding word before start of sentence
     if(is_last)
-        prev_prec = NULL;
-    ht->count++;
+        cur->prev_prec = NULL;
+    __atomic_fetch_add(&ht->count, 1, __ATOMIC_RELAXED);
+
+    return node;
+}
+
+/* Function:     find_or_add_node()
+ * Description:  Lock-free lookup of the key/word pair, inserting it if absent.  A new node
+ *        is pushed onto the head of the bucket with a CAS.  If another thread
+ *        changed the head first the chain is searched again, since that
+ *        thread may have inserted the same word, and the spare node is freed.
+ */
+
+static NODE *find_or_add_node(HASH_TABLE *ht, unsigned key, char *word, unsigned is_first, unsigned is_last) {
+    NODE    *head,
+        *node,
+        *new = NULL;
+
+    head = __atomic_load_n(&ht->bucket[key], __ATOMIC_ACQUIRE);
+    for(;;) {
+        for(node = head; node && strcmp(node->word, word); node = node->next)
+            ;
+        if(node)
+            break;
+        if(!new)
+            new = create_node(key, word, is_first, is_last);
+        new->next = head;
+        if(__atomic_compare_exchange_n(&ht->bucket[key], &head, new, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return new;
+    }
+    if(new) {
+        free(new->word);
+        free(new);
+    }
+    __atomic_fetch_add(&node->freq, 1, __ATOMIC_RELAXED);
+    if(is_first)
+        __atomic_fetch_add(&node->first, 1, __ATOMIC_RELAXED);
+    if(is_last)
+        __atomic_fetch_add(&node->last, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+/* Function:     find_or_add_prec()
+ * Description:  Lock-free version of the PREC INSERTION step of insert_node(), the new
+ *        edge is CAS-prepended to node->prec.
+ */
+
+static PREC *find_or_add_prec(NODE *prev_node, NODE *node) {
+    PREC    *head,
+        *prec,
+        *new = NULL;
+
+    head = __atomic_load_n(&node->prec, __ATOMIC_ACQUIRE);
+    for(;;) {
+        for(prec = head; prec && prec->node != prev_node; prec = prec->next)
+            ;
+        if(prec)
+            break;
+        if(!new)
+            new = add_prec(prev_node, head);
+        new->next = head;
+        if(__atomic_compare_exchange_n(&node->prec, &head, new, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&node->sum_prec, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&node->num_prec, 1, __ATOMIC_RELAXED);
+            return new;
+        }
+    }
+    free(new);
+    __atomic_fetch_add(&prec->freq, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&node->num_prec, 1, __ATOMIC_RELAXED);
+    return prec;
+}
+
+/* Function:     find_or_add_succ()
+ * Description:  Lock-free count of 'node' in a list of successors, CAS-prepending it if
+ *        absent.  'num' is the owner's count of unique successors.
+ */
+
+static void find_or_add_succ(SUCC **list, NODE *node, unsigned *num) {
+    SUCC    *head,
+        *succ,
+        *new = NULL;
+
+    head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+    for(;;) {
+        for(succ = head; succ && succ->node != node; succ = succ->next)
+            ;
+        if(succ)
+            break;
+        if(!new)
+            new = add_succ(head, node);
+        new->next = head;
+        if(__atomic_compare_exchange_n(list, &head, new, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(num, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    free(new);
+    __atomic_fetch_add(&succ->freq, 1, __ATOMIC_RELAXED);
+}
+
+/* Function:     insert_node_atomic()
+ * Description:  Same as insert_node() but safe to call from many threads at once, each
+ *        with its own cursor.  Nodes and edges are only ever prepended with a
+ *        CAS and all counters are updated with atomic adds, so there is no lock
+ *        and no per-thread table to merge afterwards.
+ */
+
+static NODE *insert_node_atomic(HASH_TABLE *ht, CURSOR *cur, unsigned key, char *word, unsigned is_last) {
+    NODE    *prev_node = cur->prev,
+        *node;
+    PREC    *prec = NULL;
+
+    node = find_or_add_node(ht, key, word, !prev_node, is_last);
+    if(prev_node) {
+        prec = find_or_add_prec(prev_node, node);
+        if(cur->prev_was_first) {
+            find_or_add_succ(&prev_node->succ, node, &prev_node->num_succ);
+            __atomic_fetch_add(&prev_node->sum_succ, 1, __ATOMIC_RELAXED);
+            cur->prev_was_first = 0;
+        }
+    }
+    else {
+        __atomic_fetch_add(&ht->sentences, 1, __ATOMIC_RELAXED);
+        cur->prev_was_first = 1;
+    }
+    if(cur->prev_prec) {
+        find_or_add_succ(&cur->prev_prec->succ, node, &cur->prev_prec->num_succ);
+        __atomic_fetch_add(&cur->prev_prec->sum_succ, 1, __ATOMIC_RELAXED);
+    }
+    if(prev_node)
+        cur->prev_prec = prec;
+    if(is_last)
+        cur->prev_prec = NULL;
+    __atomic_fetch_add(&ht->count, 1, __ATOMIC_RELAXED);
 
     return node;
 }
@@ -290,6 +443,7 @@ static NODE *create_node(unsigned key, char *word, unsigned is_first, unsigned i
     node->word = malloc(strlen(word) + 1);
     strcpy(node->word, word);
     node->key = key;
+    node->id = 0;
     node->freq = 1;
     node->first = is_first;
     node->last = is_last;
@@ -300,7 +454,8 @@ static NODE *create_node(unsigned key, char *word, unsigned is_first, unsigned i
     node->next = NULL;
     node->prec= NULL;
     node->succ = NULL;
-    node->punc = malloc(sizeof(PUNC));
+    memset(&node->punc, 0, sizeof(node->punc));
+    memset(node->shape, 0, sizeof(node->shape));
     return node;
 }
 
@@ -358,40 +513,248 @@ static void print_nodes_in_bucket(NODE *node) {
  */
 
 void print_all_nodes(HASH_TABLE *ht) {
-    for(unsigned i = 0; i < USHRT_MAX; i++) {
+    for(unsigned i = 0; i < BUCKETS; i++) {
         if(ht->bucket[i]) {
             print_nodes_in_bucket(ht->bucket[i]);
         }
     }
 }
 
-/* Function:    insert_words()
- * Description: Doing the dirty work of building the hash table from
- *        a file pointer.  The function scans in words, parses
- *        them, and then inserts them into the table.
+/* Function:    make_token()
+ * Description: Parse and normalize the word in tok->word and hash it, all
+ *        the work on a word that does not touch the table.
  */
 
-void insert_words(HASH_TABLE *ht, FILE *fp) {
-    static NODE *node = NULL;
-    char     buf[64];
-    unsigned is_last = 0;
-    
-    while(fscanf(fp, "%s", buf) != EOF) {
-        PUNC    punc = {0};
-        punc = parse(buf);
-        // either check if we are a "word" inside parse or another method. If we are not a word, then we can
-        // discard the word (reset the previous node and "is_last" parameters) and move onto the next one
-        is_last = punc.period | punc.question | punc.bang;
-        node = insert_node(ht, gen_hash(buf), buf, node, is_last);
-        update_punc(node->punc, &punc);
-        // if last word in sentence, reset node pointer and is_last flag
-        // node == NULL flags insert_node that next word is first in sentence
-        if(is_last) {
-            node = NULL;
-            is_last = 0;
+void make_token(TOKEN *tok) {
+    tok->punc = parse(tok->word);
+    tok->shape = normalize(tok->word);
+    // either check if we are a "word" inside parse or another method. If we are not a word, then we can
+    // discard the word (reset the previous node and "is_last" parameters) and move onto the next one
+    tok->is_last = tok->punc.period | tok->punc.question | tok->punc.bang;
+    tok->key = gen_hash(tok->word);
+}
+
+/* Function:    insert_token()
+ * Description: Insert a word prepared by make_token().  'mode' picks how the
+ *        table is shared: INS_SERIAL for a single thread, INS_ATOMIC for the
+ *        lock-free insert_node_atomic(), and INS_LOCKED to run insert_node()
+ *        under the locks of the buckets it touches, the word's and the
+ *        previous word's.
+ */
+
+NODE *insert_token(HASH_TABLE *ht, CURSOR *cur, TOKEN *tok, INS_MODE mode) {
+    NODE    *node;
+    unsigned is_first = !cur->prev,
+        lock[2] = {0, 0};
+
+    switch(mode) {
+    case INS_ATOMIC:
+        node = insert_node_atomic(ht, cur, tok->key, tok->word, tok->is_last);
+        update_punc_atomic(&node->punc, &tok->punc);
+        if(!is_first || tok->shape != SHAPE_CAPITAL)
+            update_shape_atomic(node->shape, tok->shape);
+        break;
+    case INS_LOCKED:
+        // always lock the lower bucket first
+        lock[0] = tok->key;
+        lock[1] = cur->prev ? cur->prev->key : tok->key;
+        if(lock[0] > lock[1]) {
+            lock[0] = lock[1];
+            lock[1] = tok->key;
         }
+        pthread_mutex_lock(&ht->locks[lock[0]]);
+        if(lock[1] != lock[0])
+            pthread_mutex_lock(&ht->locks[lock[1]]);
+        /* fall through */
+    default:
+        node = insert_node(ht, cur, tok->key, tok->word, tok->is_last);
+        update_punc(&node->punc, &tok->punc);
+        // a capital at the start of a sentence says nothing about the word
+        if(!is_first || tok->shape != SHAPE_CAPITAL)
+            update_shape(node->shape, tok->shape);
+        break;
     }
-    
+    if(mode == INS_LOCKED) {
+        if(lock[1] != lock[0])
+            pthread_mutex_unlock(&ht->locks[lock[1]]);
+        pthread_mutex_unlock(&ht->locks[lock[0]]);
+    }
+    // if last word in sentence, reset node pointer
+    // prev == NULL flags insert_node that next word is first in sentence
+    cur->prev = tok->is_last ? NULL : node;
+    return node;
+}
+
+/* Function:    find_node()
+ * Description: Return the node of 'word', NULL if it is not in the table.
+ */
+
+NODE *find_node(HASH_TABLE *ht, char *word) {
+    NODE    *node = ht->bucket[gen_hash(word)];
+
+    while(node && strcmp(node->word, word))
+        node = node->next;
+    return node;
+}
+
+/* Function:    count_token()
+ * Description: Count a word without recording any edge: update (or create)
+ *        its node's freq, first, last, punctuation and case.  Used when the
+ *        edges are counted outside of the table, see count_words().
+ */
+
+NODE *count_token(HASH_TABLE *ht, TOKEN *tok, unsigned is_first) {
+    NODE    *node = ht->bucket[tok->key];
+
+    while(node && strcmp(node->word, tok->word))
+        node = node->next;
+    if(node) {
+        node->freq++;
+        node->first += is_first;
+        node->last += tok->is_last;
+    }
+    else {
+        node = create_node(tok->key, tok->word, is_first, tok->is_last);
+        node->next = ht->bucket[tok->key];
+        ht->bucket[tok->key] = node;
+    }
+    update_punc(&node->punc, &tok->punc);
+    if(!is_first || tok->shape != SHAPE_CAPITAL)
+        update_shape(node->shape, tok->shape);
+    ht->count++;
+    ht->sentences += is_first;
+    return node;
+}
+
+/* Function:    load_node()
+ * Description: Add a node for 'word' with all counts zero, for loading a
+ *        saved table.  The word must not be in the table yet.
+ */
+
+NODE *load_node(HASH_TABLE *ht, char *word) {
+    unsigned key = gen_hash(word);
+    NODE    *node = create_node(key, word, 0, 0);
+
+    node->freq = 0;
+    node->next = ht->bucket[key];
+    ht->bucket[key] = node;
+    return node;
+}
+
+/* Function:    load_prec()
+ * Description: Add the edge (prev_node, node) seen 'freq' times.
+ */
+
+PREC *load_prec(NODE *prev_node, NODE *node, unsigned freq) {
+    node->prec = add_prec(prev_node, node->prec);
+    node->prec->freq = freq;
+    node->sum_prec++;
+    node->num_prec += freq;
+    return node->prec;
+}
+
+/* Function:    load_succ()
+ * Description: Add 'next' as a successor seen 'freq' times, either of the
+ *        edge 'prec' or, when 'prec' is NULL, of 'node' starting a sentence.
+ */
+
+void load_succ(NODE *node, PREC *prec, NODE *next, unsigned freq) {
+    if(prec) {
+        prec->succ = add_succ(prec->succ, next);
+        prec->succ->freq = freq;
+        prec->num_succ++;
+        prec->sum_succ += freq;
+    }
+    else {
+        node->succ = add_succ(node->succ, next);
+        node->succ->freq = freq;
+        node->num_succ++;
+        node->sum_succ += freq;
+    }
+}
+
+/* Function:    merge_node()
+ * Description:    Return the node of 'dst' spelled like 'node', added if
+ *        missing.
+ */
+
+static NODE *merge_node(HASH_TABLE *dst, NODE *node) {
+    NODE    *to = find_node(dst, node->word);
+
+    return to ? to : load_node(dst, node->word);
+}
+
+/* Function:    merge_succs()
+ * Description:    Add the successor list 'succ' to the edge 'prec' of 'dst',
+ *        or to 'node' starting a sentence when 'prec' is NULL.
+ */
+
+static void merge_succs(HASH_TABLE *dst, NODE *node, PREC *prec, SUCC *succ) {
+    NODE    *next;
+    SUCC    *s;
+
+    for(; succ; succ = succ->next) {
+        next = merge_node(dst, succ->node);
+        if(!(s = find_succ(next, prec ? prec->succ : node->succ)))
+            load_succ(node, prec, next, succ->freq);
+        else if(prec) {
+            s->freq += succ->freq;
+            prec->sum_succ += succ->freq;
+        }
+        else {
+            s->freq += succ->freq;
+            node->sum_succ += succ->freq;
+        }
+    }
+}
+
+/* Function:    merge_table()
+ * Description:    Add every count of 'src' to 'dst', words and edges that
+ *        'dst' lacks are created.  'src' is left as it was.
+ */
+
+void merge_table(HASH_TABLE *dst, HASH_TABLE *src) {
+    NODE    *node,
+        *to,
+        *from;
+    PREC    *prec,
+        *p;
+
+    while((node = get_next_node(src))) {
+        to = merge_node(dst, node);
+        to->freq += node->freq;
+        to->first += node->first;
+        to->last += node->last;
+        update_punc(&to->punc, &node->punc);
+        merge_shape(to->shape, node->shape);
+        merge_succs(dst, to, NULL, node->succ);
+        for(prec = node->prec; prec; prec = prec->next) {
+            from = merge_node(dst, prec->node);
+            if((p = find_prec(from, to))) {
+                p->freq += prec->freq;
+                to->num_prec += prec->freq;
+            }
+            else
+                p = load_prec(from, to, prec->freq);
+            merge_succs(dst, to, p, prec->succ);
+        }
+    }
+    dst->count += src->count;
+    dst->sentences += src->sentences;
+}
+
+/* Function:    node_cmp()
+ * Description:    qsort() comparison of NODE pointers, most frequent first
+ *        and then by word so the order is the same on every run.
+ */
+
+int node_cmp(const void *x, const void *y) {
+    const NODE *a = *(NODE * const *)x,
+        *b = *(NODE * const *)y;
+
+    if(a->freq != b->freq)
+        return a->freq < b->freq ? 1 : -1;
+    return strcmp(a->word, b->word);
 }
 
 /* Function:    get_next_node()
@@ -407,7 +770,7 @@ NODE *get_next_node(HASH_TABLE *ht) {
     static unsigned i = 0;
     
     assert(ht);
-    if(ht != local_ht || i == USHRT_MAX) {
+    if(ht != local_ht || i == BUCKETS) {
         //printf("resetting %s local vars\n", __FUNCTION__);
         local_ht = ht;
         local_node = NULL;
@@ -419,10 +782,37 @@ NODE *get_next_node(HASH_TABLE *ht) {
             local_node = local_node->next;
         else 
             local_node = local_ht->bucket[i++];
-    } while(!local_node && i < USHRT_MAX);
+    } while(!local_node && i < BUCKETS);
     return local_node;
 }
 
+/* Function:    table_stats()
+ * Description: Count the words and edges in the table and the memory they
+ *        take.  The spellings normalize() merged are not kept, compare with
+ *        a run without normalization to see what it saved.
+ */
+
+void table_stats(HASH_TABLE *ht, STATS *st) {
+    NODE    *node;
+    PREC    *prec;
+    SUCC    *succ;
+
+    assert(ht && st);
+    memset(st, 0, sizeof(*st));
+    while((node = get_next_node(ht))) {
+        st->words++;
+        st->bytes += sizeof(*node) + strlen(node->word) + 1;
+        for(succ = node->succ; succ; succ = succ->next)
+            st->succs++;
+        for(prec = node->prec; prec; prec = prec->next) {
+            st->precs++;
+            for(succ = prec->succ; succ; succ = succ->next)
+                st->succs++;
+        }
+    }
+    st->bytes += (size_t)st->precs * sizeof(PREC) + (size_t)st->succs * sizeof(SUCC);
+}
+
 /* Function:    get_sentences()
  * Description: Return the number of sentences in the hash table.
  */
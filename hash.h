@@ -7,8 +7,11 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "parse.h"
 
+#define BUCKETS	(USHRT_MAX + 1)	// gen_hash() returns 16 bits
+
 typedef struct succ {
 	struct node *node;	// node of the successor
 	struct succ *next;	// the next successor
@@ -26,6 +29,7 @@ typedef struct prec {
 
 typedef struct node {
 	unsigned key;		// hash value
+	unsigned id;		// dense number, set when saving or counting out of core
 	unsigned first;		// num times word is first in sentence
 	unsigned last;		// num times word is last in setence
 	unsigned freq;		// num times word occurs
@@ -37,23 +41,61 @@ typedef struct node {
 	char	*word;		// hashed word
 	PREC	*prec;		// list of preceeding words (nodes)
 	SUCC	*succ;		// ONLY FOR BEGINNING OF SENTENCES, need to know which words follow
-	PUNC	*punc;		// vector of freq of punctuation marks
+	PUNC	punc;		// freq of punctuation marks, see update_punc()
+	unsigned char shape[SHAPES]; // freq of each case the word was seen in
 } NODE;
 	
+typedef struct {
+	unsigned words;		// unique words (nodes)
+	unsigned precs;		// (prev, word) edges
+	unsigned succs;		// (prev, word, next) and sentence start edges
+	size_t	bytes;		// memory held by nodes, words and edges
+} STATS;
+
+typedef struct {
+	NODE	*prev;		// previous word, NULL at the start of a sentence
+	PREC	*prev_prec;	// edge (prev-prev, prev), gets the next word as successor
+	unsigned prev_was_first;// prev started the sentence
+} CURSOR;			// where one stream of words is in its sentence
+
+typedef struct {
+	char	word[WORD_LEN];	// parsed and normalized word
+	unsigned key;		// its hash
+	unsigned is_last;	// ends a sentence
+	PUNC	punc;		// punctuation it came with
+	SHAPE	shape;		// case it was written in
+} TOKEN;			// a word ready to be inserted, see make_token()
+
+typedef enum {
+	INS_SERIAL = 0,		// one thread owns the table
+	INS_ATOMIC,		// lock-free, many threads
+	INS_LOCKED		// a mutex per bucket, many threads
+} INS_MODE;
+
 typedef struct {
 	unsigned count;
 	unsigned sentences;
-	NODE	*bucket[USHRT_MAX];
+	pthread_mutex_t *locks;	// one per bucket, only for INS_LOCKED
+	NODE	*bucket[BUCKETS];
 } HASH_TABLE;
 
 HASH_TABLE *create_table();
 HASH_TABLE *clear_table(HASH_TABLE *);
 NODE *get_next_node(HASH_TABLE *);
-void insert_words(HASH_TABLE *, FILE *);
+void make_token(TOKEN *);
+NODE *insert_token(HASH_TABLE *, CURSOR *, TOKEN *, INS_MODE);
+NODE *find_node(HASH_TABLE *, char *);
+NODE *count_token(HASH_TABLE *, TOKEN *, unsigned);
+NODE *load_node(HASH_TABLE *, char *);
+PREC *load_prec(NODE *, NODE *, unsigned);
+void load_succ(NODE *, PREC *, NODE *, unsigned);
+void merge_table(HASH_TABLE *, HASH_TABLE *);
+int node_cmp(const void *, const void *);
 void print_all_nodes(HASH_TABLE *);
 void rem_table(HASH_TABLE *);
 unsigned get_sentences(HASH_TABLE *);
 PREC *find_prec(NODE *, NODE *);
+void table_stats(HASH_TABLE *, STATS *);
 
 #endif /* HASH_H */
 
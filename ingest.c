@@ -0,0 +1,375 @@
+#include "ingest.h"
+
+#include <time.h>
+
+/* File:        ingest.c
+ * Description: Build the table from a corpus.  insert_words() runs a
+ *        three stage pipeline, reading, tokenizing and inserting on their
+ *        own threads.  insert_words_mt() has several threads insert into
+ *        the same table at once: the calling thread reads the corpus in
+ *        blocks of whole sentences and queues them, the workers insert
+ *        every word of a block with their own cursor.
+ */
+
+typedef struct {
+	unsigned n;
+	TOKEN	tok[BATCH_SIZE];
+} BATCH;
+
+typedef struct {
+	HASH_TABLE *ht;
+	FILE	*fp;
+	RING	*blocks;	// reader to tokenizer
+	RING	*free_blocks;	// tokenizer back to reader
+	RING	*batches;	// tokenizer to inserter
+	RING	*free_batches;	// inserter back to tokenizer
+	PIPE_STATS *st;
+} PIPELINE;
+
+typedef struct {
+	HASH_TABLE *ht;
+	INS_MODE mode;
+	QUEUE	*full;		// blocks waiting to be inserted
+	QUEUE	*empty;		// blocks the reader may fill again
+} WORKER;
+
+/* Function:    now()
+ * Description: Monotonic time in seconds.
+ */
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Function:    read_stage()
+ * Description: First stage, fill empty blocks from the file.  A block is
+ *        passed on once the next one has taken its leftover text.  A NULL
+ *        block marks the end of the file.
+ */
+
+static void *read_stage(void *arg) {
+	PIPELINE *p = arg;
+	STAGE	*st = &p->st->read;
+	BLOCK	*blk,
+		*prev = NULL;
+	double	t = now();
+
+	for(;;) {
+		st->wait += ring_pop(p->free_blocks, (void **)&blk);
+		read_block(p->fp, blk, prev);
+		if(prev)
+			st->wait += ring_push(p->blocks, prev);
+		if(!blk->size)
+			break;
+		st->items++;
+		st->bytes += blk->len;
+		prev = blk;
+	}
+	ring_push(p->blocks, NULL);
+	st->busy = now() - t - st->wait;
+	return NULL;
+}
+
+/* Function:    tokenize_stage()
+ * Description: Second stage, split blocks into words and run make_token()
+ *        on each, handing them on in batches.  The hashing happens here so
+ *        the inserter only touches the table.
+ */
+
+static void *tokenize_stage(void *arg) {
+	PIPELINE *p = arg;
+	STAGE	*st = &p->st->tokenize;
+	BLOCK	*blk;
+	BATCH	*batch = NULL;
+	TOKEN	*tok;
+	char	*pos;
+	double	t = now();
+
+	for(;;) {
+		st->wait += ring_pop(p->blocks, (void **)&blk);
+		if(!blk)
+			break;
+		pos = blk->data;
+		reset_parse();
+		for(;;) {
+			if(!batch) {
+				st->wait += ring_pop(p->free_batches, (void **)&batch);
+				batch->n = 0;
+			}
+			tok = &batch->tok[batch->n];
+			if(!next_word(&pos, tok->word, sizeof(tok->word)))
+				break;
+			make_token(tok);
+			st->items++;
+			if(++batch->n == BATCH_SIZE) {
+				st->wait += ring_push(p->batches, batch);
+				batch = NULL;
+			}
+		}
+		st->bytes += blk->len;
+		st->wait += ring_push(p->free_blocks, blk);
+	}
+	if(batch)
+		ring_push(p->batches, batch);
+	ring_push(p->batches, NULL);
+	st->busy = now() - t - st->wait;
+	return NULL;
+}
+
+/* Function:    insert_batch()
+ * Description: Insert a batch of words.  The bucket slot of the word
+ *        2 * PREFETCH ahead and the chain head of the word PREFETCH ahead are
+ *        prefetched, so by the time a word is inserted the first node it
+ *        compares against is in cache.
+ */
+
+static void insert_batch(HASH_TABLE *ht, CURSOR *cur, BATCH *batch) {
+	TOKEN	*tok = batch->tok;
+	unsigned i,
+		n = batch->n;
+
+	for(i = 0; i < 2 * PREFETCH && i < n; i++)
+		__builtin_prefetch(&ht->bucket[tok[i].key]);
+	for(i = 0; i < n; i++) {
+		if(i + 2 * PREFETCH < n)
+			__builtin_prefetch(&ht->bucket[tok[i + 2 * PREFETCH].key]);
+		if(i + PREFETCH < n)
+			__builtin_prefetch(ht->bucket[tok[i + PREFETCH].key]);
+		insert_token(ht, cur, &tok[i], INS_SERIAL);
+	}
+}
+
+/* Function:    insert_words()
+ * Description: Doing the dirty work of building the hash table from
+ *        a file pointer.  Reading, tokenizing and inserting each run on
+ *        their own thread, handing work on through ring buffers, so that
+ *        I/O stalls and table cache misses overlap.  The inserter is the
+ *        calling thread.  If 'stats' is given it gets what each stage did.
+ */
+
+void insert_words(HASH_TABLE *ht, FILE *fp, PIPE_STATS *stats) {
+	PIPE_STATS local;
+	PIPELINE p = {ht, fp};
+	BLOCK	*blocks[PIPE_BLOCKS];
+	BATCH	*batches[PIPE_BATCHES],
+		*batch;
+	STAGE	*st;
+	CURSOR	cur = {0};
+	pthread_t reader,
+		tokenizer;
+	unsigned i;
+	double	t = now(),
+		t_insert;
+
+	assert(ht && fp);
+	p.st = stats ? stats : &local;
+	memset(p.st, 0, sizeof(*p.st));
+	st = &p.st->insert;
+	p.blocks = create_ring(PIPE_BLOCKS);
+	p.free_blocks = create_ring(PIPE_BLOCKS);
+	p.batches = create_ring(PIPE_BATCHES);
+	p.free_batches = create_ring(PIPE_BATCHES);
+	for(i = 0; i < PIPE_BLOCKS; i++)
+		ring_push(p.free_blocks, blocks[i] = create_block(BLOCK_SIZE));
+	for(i = 0; i < PIPE_BATCHES; i++) {
+		batches[i] = malloc(sizeof(BATCH));
+		assert(batches[i]);
+		ring_push(p.free_batches, batches[i]);
+	}
+	pthread_create(&reader, NULL, read_stage, &p);
+	pthread_create(&tokenizer, NULL, tokenize_stage, &p);
+
+	t_insert = now();
+	for(;;) {
+		st->wait += ring_pop(p.batches, (void **)&batch);
+		if(!batch)
+			break;
+		insert_batch(ht, &cur, batch);
+		st->items += batch->n;
+		st->wait += ring_push(p.free_batches, batch);
+	}
+	st->busy = now() - t_insert - st->wait;
+	st->bytes = p.st->tokenize.bytes;
+
+	pthread_join(reader, NULL);
+	pthread_join(tokenizer, NULL);
+	for(i = 0; i < PIPE_BLOCKS; i++)
+		rem_block(blocks[i]);
+	for(i = 0; i < PIPE_BATCHES; i++)
+		free(batches[i]);
+	rem_ring(p.blocks);
+	rem_ring(p.free_blocks);
+	rem_ring(p.batches);
+	rem_ring(p.free_batches);
+	p.st->elapsed = now() - t;
+}
+
+/* Function:    print_pipe_stats()
+ * Description: Print the throughput of each stage while it was busy and
+ *        the share of the run it spent waiting.  The stage that hardly
+ *        waits is the bottleneck.
+ */
+
+void print_pipe_stats(PIPE_STATS *st, FILE *fp) {
+	STAGE	*stage[] = {&st->read, &st->tokenize, &st->insert};
+	const char *name[] = {"read", "tokenize", "insert"};
+	unsigned i;
+
+	for(i = 0; i < 3; i++) {
+		fprintf(fp, "%-9s %8.2f MB/s", name[i],
+			stage[i]->busy > 0 ? stage[i]->bytes / stage[i]->busy / 1e6 : 0);
+		// the reader counts blocks, not words
+		if(i)
+			fprintf(fp, " %8.2f Mwords/s", stage[i]->busy > 0 ? stage[i]->items / stage[i]->busy / 1e6 : 0);
+		else
+			fprintf(fp, " %17s", "");
+		fprintf(fp, "  busy %5.1f%%  waiting %5.1f%%\n",
+			st->elapsed > 0 ? 100 * stage[i]->busy / st->elapsed : 0,
+			st->elapsed > 0 ? 100 * stage[i]->wait / st->elapsed : 0);
+	}
+}
+
+/* Function:    init_queue()
+ * Description: Initialize a queue holding up to 'size' blocks.
+ */
+
+static void init_queue(QUEUE *q, unsigned size) {
+	q->slot = malloc(size * sizeof(*q->slot));
+	assert(q->slot);
+	q->size = size;
+	q->head = q->count = q->closed = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+/* Function:    free_queue()
+ * Description: Release the queue, the blocks are not freed.
+ */
+
+static void free_queue(QUEUE *q) {
+	free(q->slot);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+}
+
+/* Function:    push()
+ * Description: Add a block to the queue, there is always room since the
+ *        number of blocks is fixed.
+ */
+
+static void push(QUEUE *q, BLOCK *blk) {
+	pthread_mutex_lock(&q->lock);
+	assert(q->count < q->size);
+	q->slot[(q->head + q->count++) % q->size] = blk;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Function:    pop()
+ * Description: Take the oldest block off the queue, waiting for one.
+ *        Returns NULL once the queue is closed and empty.
+ */
+
+static BLOCK *pop(QUEUE *q) {
+	BLOCK	*blk = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while(!q->count && !q->closed)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if(q->count) {
+		blk = q->slot[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return blk;
+}
+
+/* Function:    close_queue()
+ * Description: Wake everyone waiting, no more blocks are coming.
+ */
+
+static void close_queue(QUEUE *q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Function:    work()
+ * Description: Worker thread, insert every word of each block it gets.
+ *        Blocks end on a sentence, so each one starts with a fresh cursor.
+ */
+
+static void *work(void *arg) {
+	WORKER	*w = arg;
+	BLOCK	*blk;
+	CURSOR	cur;
+	TOKEN	tok;
+	char	*pos;
+
+	while((blk = pop(w->full))) {
+		memset(&cur, 0, sizeof(cur));
+		pos = blk->data;
+		reset_parse();
+		while(next_word(&pos, tok.word, sizeof(tok.word))) {
+			make_token(&tok);
+			insert_token(w->ht, &cur, &tok, w->mode);
+		}
+		push(w->empty, blk);
+	}
+	return NULL;
+}
+
+/* Function:    insert_words_mt()
+ * Description: insert_words() with 'threads' workers sharing the table,
+ *        either through the lock-free INS_ATOMIC path or the INS_LOCKED
+ *        mutex-per-bucket baseline.
+ */
+
+void insert_words_mt(HASH_TABLE *ht, FILE *fp, unsigned threads, INS_MODE mode) {
+	pthread_t tid[threads];
+	unsigned i,
+		nblocks = 2 * threads + 1;
+	QUEUE	full,
+		empty;
+	WORKER	w = {ht, mode, &full, &empty};
+	BLOCK	*blk,
+		*prev;
+
+	assert(ht && fp && threads);
+	if(mode == INS_LOCKED && !ht->locks) {
+		ht->locks = malloc(BUCKETS * sizeof(*ht->locks));
+		assert(ht->locks);
+		for(i = 0; i < BUCKETS; i++)
+			pthread_mutex_init(&ht->locks[i], NULL);
+	}
+	init_queue(&full, nblocks);
+	init_queue(&empty, nblocks);
+	for(i = 0; i < nblocks; i++)
+		push(&empty, create_block(BLOCK_SIZE));
+	for(i = 0; i < threads; i++)
+		pthread_create(&tid[i], NULL, work, &w);
+
+	// a block is queued only once the next one took its leftover text
+	prev = pop(&empty);
+	read_block(fp, prev, NULL);
+	while(prev->size) {
+		blk = pop(&empty);
+		read_block(fp, blk, prev);
+		push(&full, prev);
+		prev = blk;
+	}
+	push(&empty, prev);
+	close_queue(&full);
+	for(i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+
+	while(empty.count)
+		rem_block(pop(&empty));
+	free_queue(&full);
+	free_queue(&empty);
+}
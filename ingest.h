@@ -0,0 +1,42 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "hash.h"
+#include "input.h"
+#include "ring.h"
+
+#define BLOCK_SIZE	(1 << 20)	// text handed to a worker at a time
+#define BATCH_SIZE	256		// words handed from tokenizer to inserter
+#define PREFETCH	8		// words the inserter looks ahead
+#define PIPE_BLOCKS	4		// blocks in flight in the pipeline
+#define PIPE_BATCHES	16		// batches in flight in the pipeline
+
+typedef struct {
+	BLOCK	**slot;
+	unsigned size;
+	unsigned head;
+	unsigned count;
+	unsigned closed;	// no more blocks will be pushed
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+} QUEUE;
+
+typedef struct {
+	unsigned long items;	// blocks read, words tokenized or inserted
+	unsigned long bytes;	// text that went through the stage
+	double	busy;		// seconds spent working
+	double	wait;		// seconds waiting on a neighbouring stage
+} STAGE;
+
+typedef struct {
+	STAGE	read;		// fread() and cutting into blocks
+	STAGE	tokenize;	// next_word() and make_token()
+	STAGE	insert;		// insert_token()
+	double	elapsed;
+} PIPE_STATS;
+
+void insert_words(HASH_TABLE *, FILE *, PIPE_STATS *);
+void print_pipe_stats(PIPE_STATS *, FILE *);
+void insert_words_mt(HASH_TABLE *, FILE *, unsigned, INS_MODE);
+
+#endif /* INGEST_H */
@@ -0,0 +1,342 @@
+#include "input.h"
+#include "parse.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* File:        input.c
+ * Description: Open a corpus for insert_words().  Compressed files are
+ *        recognized by their magic bytes and decompressed on a separate
+ *        thread, which hands blocks of text to the tokenizer through a pipe
+ *        so nothing is ever written to disk.
+ */
+
+#define IN_BLOCK    (1 << 16)   // compressed bytes read per call
+#define OUT_BLOCK   (1 << 18)   // decompressed bytes handed over per write
+#define PIPE_SIZE   (1 << 20)   // requested pipe capacity, in flight blocks
+
+static FORMAT detect_format(FILE *);
+static void *decompress(void *);
+static int write_block(int, const char *, size_t);
+
+/* Function:    format_name()
+ * Description: Return a printable name for the given format.
+ */
+
+const char *format_name(FORMAT fmt) {
+	switch(fmt) {
+	case FMT_GZIP:	return "gzip";
+	case FMT_ZSTD:	return "zstd";
+	default:	return "plain";
+	}
+}
+
+/* Function:    detect_format()
+ * Description: Peek at the first bytes of the file and rewind.  gzip starts
+ *        with 1f 8b, zstd frames with 28 b5 2f fd.  Anything else is text.
+ */
+
+static FORMAT detect_format(FILE *fp) {
+	unsigned char magic[4];
+	size_t	n;
+
+	n = fread(magic, 1, sizeof(magic), fp);
+	rewind(fp);
+	if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return FMT_GZIP;
+	if(n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return FMT_ZSTD;
+	return FMT_PLAIN;
+}
+
+/* Function:    write_block()
+ * Description: Write a whole block of decompressed text into the pipe.
+ *        Returns -1 once the reading end has gone away.
+ */
+
+static int write_block(int fd, const char *buf, size_t len) {
+	ssize_t	n;
+
+	while(len) {
+		n = write(fd, buf, len);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* Function:    inflate_gzip()
+ * Description: Stream a gzip file into the pipe.  Concatenated members
+ *        (as produced by pigz or 'cat a.gz b.gz') are decoded back to back.
+ */
+
+static int inflate_gzip(FILE *src, int fd) {
+	unsigned char in[IN_BLOCK];
+	char	*out = malloc(OUT_BLOCK);
+	z_stream strm = {0};
+	int	ret = Z_OK;
+
+	assert(out);
+	// 15 + 16: expect a gzip header
+	if(inflateInit2(&strm, 15 + 16) != Z_OK) {
+		free(out);
+		return -1;
+	}
+	for(;;) {
+		if(!strm.avail_in) {
+			strm.avail_in = fread(in, 1, sizeof(in), src);
+			strm.next_in = in;
+			if(!strm.avail_in)
+				break;
+		}
+		if(ret == Z_STREAM_END)
+			inflateReset(&strm);
+		strm.next_out = (unsigned char *)out;
+		strm.avail_out = OUT_BLOCK;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			break;
+		if(write_block(fd, out, OUT_BLOCK - strm.avail_out) < 0)
+			break;
+	}
+	inflateEnd(&strm);
+	free(out);
+	return ret == Z_STREAM_END ? 0 : -1;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* Function:    inflate_zstd()
+ * Description: Stream a zstd file (one or more frames) into the pipe.
+ */
+
+static int inflate_zstd(FILE *src, int fd) {
+	unsigned char in[IN_BLOCK];
+	char	*out = malloc(OUT_BLOCK);
+	ZSTD_DStream *strm = ZSTD_createDStream();
+	ZSTD_inBuffer ib = {in, 0, 0};
+	size_t	ret = 0;
+
+	assert(out && strm);
+	ZSTD_initDStream(strm);
+	for(;;) {
+		if(ib.pos == ib.size) {
+			ib.size = fread(in, 1, sizeof(in), src);
+			ib.pos = 0;
+			if(!ib.size)
+				break;
+		}
+		ZSTD_outBuffer ob = {out, OUT_BLOCK, 0};
+		ret = ZSTD_decompressStream(strm, &ob, &ib);
+		if(ZSTD_isError(ret))
+			break;
+		if(write_block(fd, out, ob.pos) < 0)
+			break;
+	}
+	ZSTD_freeDStream(strm);
+	free(out);
+	// ret == 0 means the last frame was fully decoded
+	return ret == 0 ? 0 : -1;
+}
+#endif
+
+/* Function:    decompress()
+ * Description: Body of the decompression thread.  SIGPIPE is blocked so that
+ *        a reader which stops early just makes write() fail.
+ */
+
+static void *decompress(void *arg) {
+	INPUT	*in = arg;
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	in->status = -1;
+	switch(in->format) {
+#ifdef HAVE_ZLIB
+	case FMT_GZIP:
+		in->status = inflate_gzip(in->src, in->fd);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case FMT_ZSTD:
+		in->status = inflate_zstd(in->src, in->fd);
+		break;
+#endif
+	default:
+		break;
+	}
+	close(in->fd);
+	return NULL;
+}
+
+/* Function:    open_input()
+ * Description: Open 'path' for reading.  Plain text is returned as is, a
+ *        compressed file gets a decompression thread feeding 'fp'.  Returns
+ *        NULL if the file cannot be opened, its format was not compiled in
+ *        or the pipe or thread cannot be created.
+ */
+
+INPUT *open_input(const char *path) {
+	INPUT	*in;
+	int	fds[2],
+		err;
+
+	in = calloc(1, sizeof(*in));
+	assert(in);
+	if(!(in->src = fopen(path, "rb"))) {
+		free(in);
+		return NULL;
+	}
+	in->format = detect_format(in->src);
+	if(in->format == FMT_PLAIN) {
+		in->fp = in->src;
+		return in;
+	}
+#ifndef HAVE_ZLIB
+	if(in->format == FMT_GZIP)
+		goto unsupported;
+#endif
+#ifndef HAVE_ZSTD
+	if(in->format == FMT_ZSTD)
+		goto unsupported;
+#endif
+	if(pipe(fds) < 0) {
+		err = errno;
+		goto failed;
+	}
+#ifdef F_SETPIPE_SZ
+	fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+#endif
+	in->fp = fdopen(fds[0], "r");
+	assert(in->fp);
+	in->fd = fds[1];
+	// pthread_create() returns the error instead of setting errno
+	if((err = pthread_create(&in->thread, NULL, decompress, in))) {
+		fclose(in->fp);
+		close(fds[1]);
+		goto failed;
+	}
+	return in;
+
+unsupported:
+	fprintf(stderr, "no %s support for '%s'\n", format_name(in->format), path);
+	fclose(in->src);
+	free(in);
+	return NULL;
+
+failed:
+	fprintf(stderr, "cannot decompress '%s': %s\n", path, strerror(err));
+	fclose(in->src);
+	free(in);
+	return NULL;
+}
+
+/* Function:    close_input()
+ * Description: Close the input and wait for the decompression thread.
+ *        Returns non-zero if the compressed stream was corrupt or truncated.
+ */
+
+int close_input(INPUT *in) {
+	int	status = 0;
+
+	assert(in);
+	if(in->format != FMT_PLAIN) {
+		fclose(in->fp);
+		pthread_join(in->thread, NULL);
+		status = in->status;
+	}
+	fclose(in->src);
+	free(in);
+	return status;
+}
+
+/* Function:    create_block()
+ * Description: Allocate a block holding up to 'cap' bytes of text.
+ */
+
+BLOCK *create_block(size_t cap) {
+	BLOCK	*blk = malloc(sizeof(*blk));
+
+	assert(blk);
+	blk->data = malloc(cap + 1);
+	assert(blk->data);
+	blk->len = blk->size = 0;
+	blk->cap = cap;
+	return blk;
+}
+
+/* Function:    rem_block()
+ * Description: Free a block.
+ */
+
+void rem_block(BLOCK *blk) {
+	free(blk->data);
+	free(blk);
+}
+
+/* Function:    is_boundary()
+ * Description: Is the whitespace at data[i] the end of a sentence, i.e. does
+ *        parse() end one on the word before it, see ends_sentence().
+ */
+
+static int is_boundary(const char *data, size_t i) {
+	size_t	start = i;
+
+	while(start > 0 && !isspace((unsigned char)data[start-1]))
+		start--;
+	return ends_sentence(&data[start], i - start);
+}
+
+/* Function:    read_block()
+ * Description: Fill 'blk' with the text left over in 'prev' (which may be
+ *        'blk' itself or NULL) followed by as much of 'fp' as fits, then cut
+ *        it after the last complete sentence so blocks can be inserted
+ *        independently.  Without a sentence end the block is cut at the last
+ *        whitespace.  Returns the length of the text, 0 once 'fp' is done.
+ */
+
+size_t read_block(FILE *fp, BLOCK *blk, BLOCK *prev) {
+	size_t	carry = 0,
+		i;
+
+	if(prev && prev->size > prev->len) {
+		carry = prev->size - prev->len - 1;
+		memmove(blk->data, prev->data + prev->len + 1, carry);
+	}
+	blk->size = carry + fread(blk->data + carry, 1, blk->cap - carry, fp);
+	blk->len = blk->size;
+	if(blk->size == blk->cap) {
+		for(i = blk->size; i-- > 0; )
+			if(isspace((unsigned char)blk->data[i]) && is_boundary(blk->data, i))
+				break;
+		if(i == (size_t)-1)
+			for(i = blk->size; i-- > 0 && !isspace((unsigned char)blk->data[i]); )
+				;
+		if(i != (size_t)-1 && i > 0)
+			blk->len = i;
+	}
+	blk->cut = blk->data[blk->len];
+	blk->data[blk->len] = '\0';
+	return blk->len;
+}
@@ -0,0 +1,37 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+typedef enum {
+	FMT_PLAIN = 0,
+	FMT_GZIP,
+	FMT_ZSTD
+} FORMAT;
+
+typedef struct {
+	FILE	*fp;		// decompressed text, what insert_words() reads
+	FILE	*src;		// underlying (possibly compressed) file
+	FORMAT	format;		// detected from the magic bytes
+	int	fd;		// writing end of the pipe, owned by the thread
+	int	status;		// 0 on success, set by the decompression thread
+	pthread_t thread;	// decompression thread, unused for FMT_PLAIN
+} INPUT;
+
+typedef struct {
+	char	*data;
+	size_t	len;		// whole sentences, NUL terminated at data[len]
+	size_t	size;		// bytes held, data[len + 1] on starts the next block
+	size_t	cap;
+	char	cut;		// the whitespace the NUL replaced when size > len
+} BLOCK;
+
+INPUT *open_input(const char *);
+int close_input(INPUT *);
+const char *format_name(FORMAT);
+BLOCK *create_block(size_t);
+void rem_block(BLOCK *);
+size_t read_block(FILE *, BLOCK *, BLOCK *);
+
+#endif /* INPUT_H */
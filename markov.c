@@ -1,326 +1,279 @@
 #include "markov.h"
 
-static NODE *pick_first_word(HASH_TABLE *);
-static double gen_rand();
-static void sort_by_first(NODE **, unsigned);
-
-static pcg32_random_t rng;
-
-/* Function:	sort_by_first()
- * Description:	Quciksort array of nodes based on frequency of
- *		occurring first in a sentence
+/* Function:	build_sentence() 
+ * Description:	Main loop for building a sentence, printing each word as the
+ *		generator yields it.
  */
 
-static void sort_by_first(NODE **nodes, unsigned n) {
-	unsigned i, j, p;
-	NODE 	*t;
-
-	if(n < 2)
-		return;
-	p = nodes[n/2]->first;
-	for(i = 0, j = n - 1; ; i++, j--) {
-		while(nodes[i]->first > p)
-			i++;
-		while(p > nodes[j]->first)
-			j--;
-		if(i >= j)
+void build_sentence(GENERATOR *gen) {
+	GEN_TOKEN tok;
+	assert(gen);
+	
+	while(markov_next_token(gen, &tok)) {
+		print_token(&tok, stdout);
+		if(tok.last)
 			break;
-		t = nodes[i];
-		nodes[i] = nodes[j];
-		nodes[j] = t;
 	}
-	sort_by_first(nodes, i);
-	sort_by_first(nodes + i, n - i);
 }
 
-/* Function:	sort_by_freq()
- * Description:	Quciksort array of nodes based on frequency of
- *		occurrence.
+/* Function:	print_stats()
+ * Description:	Report the size of the model on stderr.  Run once with and
+ *		once without -f, -a or -y to see what normalization saves.
  */
 
-static void sort_by_freq(SUCC **nodes, unsigned n) {
-	unsigned i, j, p;
-	SUCC 	*t;
+static void print_stats(HASH_TABLE *ht) {
+	STATS	st;
 
-	if(n < 2)
-		return;
-	p = nodes[n/2]->freq;
-	for(i = 0, j = n - 1; ; i++, j--) {
-		while(nodes[i]->freq > p)
-			i++;
-		while(p > nodes[j]->freq)
-			j--;
-		if(i >= j)
-			break;
-		t = nodes[i];
-		nodes[i] = nodes[j];
-		nodes[j] = t;
-	}
-	sort_by_freq(nodes, i);
-	sort_by_freq(nodes + i, n - i);
+	table_stats(ht, &st);
+	fprintf(stderr, "words:\t%u\n", st.words);
+	fprintf(stderr, "precs:\t%u\n", st.precs);
+	fprintf(stderr, "succs:\t%u\n", st.succs);
+	fprintf(stderr, "memory:\t%zu bytes\n", st.bytes);
 }
 
-/* Function:	end_sentence() 
- * Description:	Given a node, determine if the sentence should end.
+/* Function:	predict_lines()
+ * Description:	Read one context per line from 'fp', the start of a sentence,
+ *		and print the k most likely next words with their probability.
  */
 
-// TODO: instead of bias, use average length of sentence
-static unsigned end_sentence(NODE *node) {
-	double end_prob = 0,
-		d = 0;
+static void predict_lines(HASH_TABLE *ht, FILE *fp, unsigned k) {
+	PREDICTOR *pd = create_predictor(ht);
+	CONTEXT	*ctx;
+	TOKEN	tok;
+	NODE	*a,
+		*b;
+	char	*line = NULL,
+		*pos;
+	size_t	cap = 0;
+	unsigned i,
+		first;
 
-	if(node->last) {
-		//printf("chance of ending equal to \"of the total freq, how often is it ending a sentence\"\n");
-		//printf("\tnode->last/node->freq = %lf\n", end_prob = (double)node->last/node->freq);
-		end_prob = (double)node->last/node->freq;
-		d = gen_rand();
-		if(end_prob > d) {
-			printf(".\n");
-			return 1;
+	while(getline(&line, &cap, fp) != -1) {
+		a = CTX_START;
+		b = NULL;
+		first = 1;
+		reset_parse();
+		for(pos = line; next_word(&pos, tok.word, sizeof(tok.word)); ) {
+			make_token(&tok);
+			// the first word of a sentence follows CTX_START
+			a = first ? CTX_START : b;
+			b = find_node(ht, tok.word);
+			first = 0;
+			if(tok.is_last) {
+				a = CTX_START;
+				b = NULL;
+				first = 1;
+			}
 		}
+		// an unknown last word leaves no context, an empty one the start
+		ctx = predict(pd, b ? a : first ? CTX_START : NULL, b);
+		for(i = 0; i < k && i < ctx->n; i++)
+			printf("%s%.4f %s", i ? "\t" : "",
+				(double)ctx->choice[i].freq / ctx->total, ctx->choice[i].node->word);
+		putchar('\n');
 	}
-	//if(node->num_succ == 0) {
-	//	printf(".\n");
-	//	return 1;
-	//}
-	return 0;
-}
-static double gen_rand() {
-	return ldexp(pcg32_random_r(&rng), -32); // random number [0, 1)
+	free(line);
+	rem_predictor(pd);
 }
-	
-/* Function:	build_density()
- * Description:	Build density array given frequencies.  Each element's value 
- *		is the previous sum probabilities plus current
- *		element's probability. Cumulative distribution.
+
+/* Function:	parse_size()
+ * Description:	Read a size such as "512M", a K, M or G suffix is optional.
  */
 
-static void build_density(double *density, unsigned n, unsigned total) {
-	unsigned i;
-	double sum = 0;
-	double temp[n];
+static size_t parse_size(const char *arg) {
+	char	*end;
+	size_t	n = strtoull(arg, &end, 10);
 
-	for(i = 0; i < n; i++ ) {
-		temp[i] = density[i];
-	}
-
-	for(i = 0; i < n; i++) {
-		sum += (double) temp[i]/total;
-		density[i] = sum;
+	switch(toupper(*end)) {
+	case 'G': n <<= 10;	/* fall through */
+	case 'M': n <<= 10;	/* fall through */
+	case 'K': n <<= 10;
 	}
+	return n;
 }
 
-/* Function:	pick_first_word()
- * Description:	Pick the first word of the sentence to construct.  Do so by
- *		creating a list of all possible words to start the sentence,
- *		sort it, and then, based on cumulative distrubition function,
- *		pick a word.
- */
-
-static NODE *pick_first_word(HASH_TABLE *ht) {
-	NODE 	*node;
-	unsigned i = 0,
-		sentences = 0,
-		choices = 0;
-	double 	sum_dist = 0,
-		word_prob = gen_rand();
-	char	buf[64];
-
-	sentences = get_sentences(ht);
-	while((node = get_next_node(ht))) {
-		if(node->first)
-			choices++;
-	}
+static void usage() {
+	printf("./markov [-f] [-a] [-y] [-A abbrevs] [-s] [-j threads] [-o model [-m memory] [-T dir]] [-c checkpoint [-C interval]] [-S file] [-P k] [-n count] [-k keyword] {text-file | model}\n");
+	printf("\t-f\tfold case, keep the original case for output\n");
+	printf("\t-a\tdrop apostrophes\n");
+	printf("\t-y\tdrop hyphens\n");
+	printf("\t-A\tfile of abbreviations not ending sentences, one per line (e.g. Dr.)\n");
+	printf("\t-s\tprint model statistics\n");
+	printf("\t-j\tbuild the table with this many threads\n");
+	printf("\t-o\tsave the model to a file instead of generating\n");
+	printf("\t-m\tcount out of core within this much memory (e.g. 512M)\n");
+	printf("\t-T\tdirectory for out of core runs, default $TMPDIR or /tmp\n");
+	printf("\t-c\tcheckpoint training to this file, resuming from it if present\n");
+	printf("\t-C\tinput between checkpoints (e.g. 256M), default 64M\n");
+	printf("\t-S\tscore each line of this file ('-' for stdin) instead of generating\n");
+	printf("\t-n\tgenerate this many sentences, default 1\n");
+	printf("\t-k\tgenerate sentences containing this word\n");
+	printf("\t-P\tprint the k most likely next words for each context line on stdin\n");
+	printf("words are split at whitespace, scripts written without spaces (Chinese, Japanese, Thai) are not supported\n");
+	exit(1);
+}
 
-	NODE 	*nodes[choices];
-	double	density[choices];
-	while((node = get_next_node(ht))) {
-		if(node->first) {
-			nodes[i++] = node;
-		}
-	}
-	sort_by_first(nodes, choices);
-	for(i = 0; i < choices; i++)
-		density[i] = nodes[i]->first;
-	
-	build_density(density, choices, sentences);
-#if DEBUG
-	for(i = 0; i < choices; i++) {
-		printf("freq: %3u, prob: %.5lf, dist: %.5lf, word: %s\n", nodes[i]->first, (double) nodes[i]->first/sentences, density[i], nodes[i]->word);
-		sum_dist += (double)nodes[i]->first/sentences;
-	}
-#endif
+int main(int argc, char **argv) {
+	HASH_TABLE *ht;
+	PREDICTOR *pd,
+		*back;
+	GENERATOR *gen;
+	INPUT	*in;
+	PIPE_STATS pstats;
+	const char *path,
+		*out = NULL,
+		*score = NULL,
+		*ckpt = NULL,
+		*keyword = NULL,
+		*tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	size_t	memory = 0,
+		interval = CKPT_INTERVAL;
+	unsigned norm = NORM_NONE,
+		stats = 0,
+		top = 0,
+		sentences = 1,
+		threads = 0,
+		loaded = 0;
+	int	opt;
 
-	for(i = 0; i < choices; i++) {
-		if(word_prob < density[i]) {
-			node = nodes[i];
+	while((opt = getopt(argc, argv, "fayA:sj:o:m:T:c:C:S:P:n:k:h")) != -1) {
+		switch(opt) {
+		case 'f': norm |= NORM_FOLD; break;
+		case 'a': norm |= NORM_APOS; break;
+		case 'y': norm |= NORM_HYPHEN; break;
+		case 'A':
+			if(load_abbrevs(optarg)) {
+				printf("could not load abbreviations from '%s'\n", optarg);
+				exit(1);
+			}
 			break;
+		case 's': stats = 1; break;
+		case 'j': threads = atoi(optarg); break;
+		case 'o': out = optarg; break;
+		case 'm': memory = parse_size(optarg); break;
+		case 'T': tmpdir = optarg; break;
+		case 'c': ckpt = optarg; break;
+		case 'C': interval = parse_size(optarg); break;
+		case 'S': score = optarg; break;
+		case 'P': top = atoi(optarg); break;
+		case 'n': sentences = atoi(optarg); break;
+		case 'k': keyword = optarg; break;
+		default: usage();
 		}
 	}
+	if(argc - optind != 1 || (memory && !out) || ((score || top) && out) || (memory && ckpt) || !interval || (keyword && !*keyword))
+		usage();
+	path = argv[optind];
 
-	strcpy(buf, node->word);
-	buf[0] = toupper(buf[0]);
-#if DEBUG
-	printf("node chosen: %s\n", buf);
-	printf("sentences:\t%u\n", sentences);
-	printf("gen rand: %.3lf\n", word_prob);
-	printf("total sum dist: %lf\n", sum_dist);
-#endif
-	printf("%s", buf);
-
-	return node;
-}
-	
-/* Functiin:	pick_next_word()
- * Description:	Given a node, build build array of succ nodes and pick
- *		the next node based on freq and cumulative distribution.
- */
-
-static NODE *pick_next_word(NODE *node) {
-	SUCC 	*succ;
-	PREC	*prec;
-	static NODE *prev_node = NULL;
-	static unsigned was_first_word = 1;
-	unsigned i = 0,
-		size_prec = node->num_prec,
-		total_prec = node->sum_prec;
-	double 	sum_dist = 0,
-		word_prob = gen_rand();
-	
-	if(was_first_word) {
-		unsigned size = node->num_succ,
-			total = node->sum_succ;
-		SUCC *succ_nodes[size];
-		double density[size];
-
-		succ = node->succ;
-		while(succ) {
-			succ_nodes[i++] = succ;
-			sum_dist += (double)succ->freq/total;
-			succ = succ->next;
-		}
-		sort_by_freq(succ_nodes, size);
-		for(i = 0; i < size; i++) {
-			density[i] = succ_nodes[i]->freq;
-		}
-		build_density(density, size, total);
-#if DEBUG
-		for(i = 0; i < size; i++) {
-			printf("freq: %*u, distr: %.4lf, word: %s\n", 3, succ_nodes[i]->freq, density[i], succ_nodes[i]->node->word);
-		}
-#endif
-		for(i = 0; i < size; i++) {
-			if(word_prob <= density[i]) {
-				prev_node = node;
-				node = succ_nodes[i]->node;
-				break;
-			}
-		}
-		if(i == size) {
-#if DEBUG
-			printf("END OF ARRAY premature END\n");
-#endif
-			printf(".\n");
+	if(is_model(path)) {
+		ht = load_model(path);
+		if(!ht) {
+			printf("'%s' is not a valid model\n", path);
 			exit(1);
 		}
-#if DEBUG
-		printf("new PREV_NODE: %s\n", prev_node->word);
-		printf("next word: %s\n", node->word);
-		printf("total sum dist: %lf\n", sum_dist);
-#endif
-		printf(" %s", node->word);
-		was_first_word = 0;
+		loaded = 1;
 	}
-	else if(size_prec) {
-		prec = find_prec(prev_node, node);
-		assert(prec);
-
-		unsigned size = prec->num_succ,
-			total = prec->sum_succ;
-		SUCC *succ_nodes[size];
-		double density[size];
-		i = 0;
-	
-		succ = prec->succ;
-		while(succ) {
-			succ_nodes[i++] = succ;
-			sum_dist += (double)succ->freq/prec->sum_succ;
-			succ = succ->next;
-		}
-		sort_by_freq(succ_nodes, size);
-		for(i = 0; i < size; i++) {
-			density[i] = succ_nodes[i]->freq;
+	else {
+		in = open_input(path);
+		if(!in) {
+			printf("could not open '%s'\n", path);
+			exit(1);
 		}
-		build_density(density, size, total);
-#if DEBUG
-		for(i = 0; i < size; i++) {
-			printf("freq: %*u, distr: %.4lf, word: %s\n", 3, succ_nodes[i]->freq, density[i], succ_nodes[i]->node->word);
+		set_normalize(norm);
+		if(memory) {
+			// out of core, the table never exists in memory
+			if(count_words(in->fp, out, memory, tmpdir) || close_input(in)) {
+				printf("could not count '%s' into '%s'\n", path, out);
+				exit(1);
+			}
+			return 0;
 		}
-#endif
-		for(i = 0; i < size; i++) {
-			if(word_prob <= density[i]) {
-				prev_node = node;
-				node = succ_nodes[i]->node;
-				break;
+		if(ckpt) {
+			if(!(ht = checkpoint_words(in->fp, ckpt, interval, threads))) {
+				printf("could not resume '%s' from '%s'\n", path, ckpt);
+				exit(1);
 			}
 		}
-		if(i == size) {
-#if DEBUG
-			printf("END OF ARRAY premature END\n");
-#endif
-			printf(".\n");
+		else {
+			ht = create_table();
+			if(threads > 1)
+				insert_words_mt(ht, in->fp, threads, INS_ATOMIC);
+			else
+				insert_words(ht, in->fp, &pstats);
+		}
+		if(close_input(in)) {
+			printf("'%s' is corrupt or truncated\n", path);
 			exit(1);
 		}
-
-#if DEBUG
-		printf("next word: %s\n", node->word);
-		printf("total sum dist: %lf\n", sum_dist);
-#endif
-		printf(" %s", node->word);
 	}
-	else {
-#if DEBUG
-		printf(". NO PREC\n");
-#endif
-		exit(1);
+	//print_all_nodes(ht);
+	if(stats) {
+		print_stats(ht);
+		if(!loaded && !ckpt && threads <= 1)
+			print_pipe_stats(&pstats, stderr);
 	}
-	return node;
-}
-
-/* Function:	build_sentence() 
- * Description:	Main loop for building a sentence.
- */
-
-void build_sentence(HASH_TABLE *ht) {
-	NODE *node = NULL;
-	assert(ht);
-	
-	node = pick_first_word(ht);
-	while(!end_sentence(node)) {
-		node = pick_next_word(node);
+	if(out) {
+		if(save_model(ht, out)) {
+			printf("could not save '%s'\n", out);
+			exit(1);
+		}
+		return 0;
 	}
-}
+	if(score) {
+		FILE	*fp = strcmp(score, "-") ? fopen(score, "r") : stdin;
+		SCORER	*sc;
 
-int main(int argc, char **argv) {
-	HASH_TABLE *ht;
-	FILE	*fp;
-
-	if(argc != 2) {
-		printf("./markov {text-file}\n");
-		exit(1);
+		if(!fp) {
+			printf("could not find '%s'\n", score);
+			exit(1);
+		}
+		sc = create_scorer(ht);
+		score_lines(sc, ht, fp, stdout, threads);
+		rem_scorer(sc);
+		if(fp != stdin)
+			fclose(fp);
+		return 0;
 	}
-	fp = fopen(argv[1], "r");
-	if(!fp) {
-		printf("could not find '%s'\n", argv[1]);
-		exit(1);
+	if(top) {
+		predict_lines(ht, stdin, top);
+		return 0;
 	}
-	// init pcg rng
-	pcg32_srandom_r(&rng, time(NULL), (intptr_t)&rng);
-	ht = create_table();
-	// test parser
-	insert_words(ht, fp);
-	//print_all_nodes(ht);
 	
-	build_sentence(ht);
+	pd = create_predictor(ht);
+	gen = create_generator(pd, time(NULL));
+	if(keyword) {
+		TOKEN	tok;
+		NODE	*node;
+
+		// the keyword is normalized like the corpus was
+		strncpy(tok.word, keyword, sizeof(tok.word) - 1);
+		tok.word[sizeof(tok.word) - 1] = '\0';
+		make_token(&tok);
+		if(!*tok.word) {
+			printf("'%s' is no word once normalized\n", keyword);
+			exit(1);
+		}
+		back = create_backward(ht);
+		if(!(node = find_node(ht, tok.word))) {
+			printf("'%s' is not in the model\n", keyword);
+			exit(1);
+		}
+		while(sentences--) {
+			// without a queue the sentence would not contain the keyword
+			if(!seed_generator(gen, back, node)) {
+				printf("no sentence in the model can be grown around '%s'\n", keyword);
+				exit(1);
+			}
+			build_sentence(gen);
+		}
+		rem_predictor(back);
+	}
+	else
+		while(sentences--)
+			build_sentence(gen);
+	if(stats)
+		fprintf(stderr, "backoffs:\t%u of %u words\n", gen->backoffs, gen->picks);
+	rem_generator(gen);
+	rem_predictor(pd);
 	return 1;
 }
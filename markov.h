@@ -2,8 +2,14 @@
 #define MARKOV_H
 
 #include "hash.h"
-#include "pcg-c-basic-0.9/pcg_basic.h"
+#include "input.h"
+#include "ingest.h"
+#include "count.h"
+#include "checkpoint.h"
+#include "score.h"
+#include "gen.h"
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
 
 #endif /* MARKOV_H */
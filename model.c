@@ -0,0 +1,372 @@
+#include "model.h"
+
+/* File:        model.c
+ * Description: Compact on-disk format of a trained table.
+ *
+ *        header  "MKV1", then as little-endian u32: version, words,
+ *                count, sentences, normalization flags; u64 edges
+ *        words   per id: varint length, the word, varint freq, first
+ *                and last, the PUNC bytes and the case shape bytes
+ *        edges   TUPLEs sorted by (a, b, c), each a varint delta to the
+ *                previous one followed by the varint count
+ *
+ *        An edge's fields are coded relative to the previous edge only
+ *        while the fields before them are equal, so sorted runs of the same
+ *        context take a byte or two per successor.
+ */
+
+#define HEADER_SIZE	(4 + 5 * 4 + 8)
+
+/* Function:    put_varint()
+ * Description: Write 'v' seven bits at a time, low bits first.
+ */
+
+static void put_varint(FILE *fp, uint64_t v) {
+	while(v >= 0x80) {
+		putc((v & 0x7F) | 0x80, fp);
+		v >>= 7;
+	}
+	putc(v, fp);
+}
+
+/* Function:    get_varint()
+ * Description: Read a value written by put_varint(), returns -1 on EOF.
+ */
+
+static int get_varint(FILE *fp, uint64_t *v) {
+	int	c,
+		shift = 0;
+
+	*v = 0;
+	do {
+		if((c = getc(fp)) == EOF || shift > 63)
+			return -1;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while(c & 0x80);
+	return 0;
+}
+
+/* Function:    put_le()
+ * Description: Write the low 'n' bytes of 'v', little-endian.
+ */
+
+static void put_le(unsigned char *buf, uint64_t v, unsigned n) {
+	while(n--) {
+		*buf++ = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+/* Function:    get_le()
+ * Description: Read 'n' little-endian bytes.
+ */
+
+static uint64_t get_le(unsigned char *buf, unsigned n) {
+	uint64_t v = 0;
+
+	while(n--)
+		v = v << 8 | buf[n];
+	return v;
+}
+
+/* Function:    write_header()
+ * Description: Write (or rewrite) the header at the start of the file.
+ */
+
+static void write_header(FILE *fp, unsigned words, unsigned count, unsigned sentences, uint64_t edges) {
+	unsigned char buf[HEADER_SIZE];
+
+	memcpy(buf, MODEL_MAGIC, 4);
+	put_le(buf + 4, MODEL_VERSION, 4);
+	put_le(buf + 8, words, 4);
+	put_le(buf + 12, count, 4);
+	put_le(buf + 16, sentences, 4);
+	put_le(buf + 20, get_normalize(), 4);
+	put_le(buf + 24, edges, 8);
+	fwrite(buf, 1, sizeof(buf), fp);
+}
+
+/* Function:    tuple_cmp()
+ * Description: qsort() order of edges, by (a, b, c).
+ */
+
+int tuple_cmp(const void *x, const void *y) {
+	const TUPLE *s = x,
+		*t = y;
+
+	if(s->a != t->a)
+		return s->a < t->a ? -1 : 1;
+	if(s->b != t->b)
+		return s->b < t->b ? -1 : 1;
+	if(s->c != t->c)
+		return s->c < t->c ? -1 : 1;
+	return 0;
+}
+
+/* Function:    is_model()
+ * Description: Does 'path' hold a saved model rather than text.
+ */
+
+int is_model(const char *path) {
+	FILE	*fp = fopen(path, "rb");
+	char	magic[4];
+	int	ret;
+
+	if(!fp)
+		return 0;
+	ret = fread(magic, 1, 4, fp) == 4 && !memcmp(magic, MODEL_MAGIC, 4);
+	fclose(fp);
+	return ret;
+}
+
+/* Function:    create_model()
+ * Description: Start writing a model: the header and the 'n' words of
+ *        'ht', where words[i] is the node numbered i.  Its edges follow
+ *        with write_edge(), in tuple_cmp() order.  Returns NULL if the file
+ *        cannot be created.
+ */
+
+MODEL *create_model(const char *path, HASH_TABLE *ht, NODE **words, unsigned n) {
+	MODEL	*m;
+	unsigned i;
+	size_t	len;
+
+	m = calloc(1, sizeof(*m));
+	assert(m);
+	if(!(m->fp = fopen(path, "wb"))) {
+		free(m);
+		return NULL;
+	}
+	m->words = n;
+	m->count = ht->count;
+	m->sentences = ht->sentences;
+	write_header(m->fp, n, ht->count, ht->sentences, 0);
+	for(i = 0; i < n; i++) {
+		len = strlen(words[i]->word);
+		put_varint(m->fp, len);
+		fwrite(words[i]->word, 1, len, m->fp);
+		put_varint(m->fp, words[i]->freq);
+		put_varint(m->fp, words[i]->first);
+		put_varint(m->fp, words[i]->last);
+		fwrite(&words[i]->punc, 1, sizeof(PUNC), m->fp);
+		fwrite(words[i]->shape, 1, SHAPES, m->fp);
+	}
+	return m;
+}
+
+/* Function:    write_edge()
+ * Description: Append an edge, edges must come in tuple_cmp() order.
+ */
+
+void write_edge(MODEL *m, TUPLE *t) {
+	TUPLE	*last = &m->last;
+
+	if(m->edges && t->a == last->a) {
+		put_varint(m->fp, 0);
+		if(t->b == last->b) {
+			put_varint(m->fp, 0);
+			put_varint(m->fp, t->c - last->c);
+		}
+		else {
+			put_varint(m->fp, t->b - last->b);
+			put_varint(m->fp, t->c);
+		}
+	}
+	else {
+		// the first edge is coded against a = 0, plus one so a delta is never 0
+		put_varint(m->fp, t->a - (m->edges ? last->a : 0) + 1);
+		put_varint(m->fp, t->b);
+		put_varint(m->fp, t->c);
+	}
+	put_varint(m->fp, t->count);
+	*last = *t;
+	m->edges++;
+}
+
+/* Function:    close_model()
+ * Description: Record the number of edges in the header and close the
+ *        file.  Returns non-zero if anything failed to be written.
+ */
+
+int close_model(MODEL *m) {
+	int	ret;
+
+	rewind(m->fp);
+	write_header(m->fp, m->words, m->count, m->sentences, m->edges);
+	ret = ferror(m->fp);
+	ret |= fclose(m->fp);
+	free(m);
+	return ret;
+}
+
+/* Function:    save_model()
+ * Description: Number the nodes of 'ht', sort all of its edges and write
+ *        them to 'path'.  Returns non-zero on failure.
+ */
+
+int save_model(HASH_TABLE *ht, const char *path) {
+	NODE	*node,
+		**words;
+	PREC	*prec;
+	SUCC	*succ;
+	TUPLE	*edges;
+	MODEL	*m;
+	STATS	st;
+	unsigned n = 0;
+	size_t	e = 0,
+		i;
+
+	table_stats(ht, &st);
+	words = malloc(st.words * sizeof(*words) + 1);
+	edges = malloc((st.precs + st.succs) * sizeof(*edges) + 1);
+	assert(words && edges);
+	while((node = get_next_node(ht))) {
+		node->id = n;
+		words[n++] = node;
+	}
+	for(i = 0; i < n; i++) {
+		node = words[i];
+		for(succ = node->succ; succ; succ = succ->next)
+			edges[e++] = (TUPLE){node->id, succ->node->id, EDGE_START, succ->freq};
+		for(prec = node->prec; prec; prec = prec->next) {
+			edges[e++] = (TUPLE){prec->node->id, node->id, EDGE_PREC, prec->freq};
+			for(succ = prec->succ; succ; succ = succ->next)
+				edges[e++] = (TUPLE){prec->node->id, node->id, EDGE_SUCC + succ->node->id, succ->freq};
+		}
+	}
+	qsort(edges, e, sizeof(*edges), tuple_cmp);
+
+	if(!(m = create_model(path, ht, words, n))) {
+		free(words);
+		free(edges);
+		return -1;
+	}
+	for(i = 0; i < e; i++)
+		write_edge(m, &edges[i]);
+	free(words);
+	free(edges);
+	return close_model(m);
+}
+
+/* Function:    read_word()
+ * Description: Read one word and its counts into a new node of 'ht'.
+ */
+
+static NODE *read_word(FILE *fp, HASH_TABLE *ht) {
+	char	buf[64];
+	uint64_t len,
+		freq,
+		first,
+		last;
+	NODE	*node;
+
+	if(get_varint(fp, &len) || len >= sizeof(buf) || fread(buf, 1, len, fp) != len)
+		return NULL;
+	buf[len] = '\0';
+	if(get_varint(fp, &freq) || get_varint(fp, &first) || get_varint(fp, &last))
+		return NULL;
+	node = load_node(ht, buf);
+	node->freq = freq;
+	node->first = first;
+	node->last = last;
+	if(fread(&node->punc, 1, sizeof(PUNC), fp) != sizeof(PUNC) || fread(node->shape, 1, SHAPES, fp) != SHAPES)
+		return NULL;
+	return node;
+}
+
+/* Function:    read_edge()
+ * Description: Read the edge following 'last', undoing write_edge().
+ */
+
+static int read_edge(FILE *fp, TUPLE *t, TUPLE *last) {
+	uint64_t da,
+		b,
+		c,
+		count;
+
+	if(get_varint(fp, &da) || get_varint(fp, &b) || get_varint(fp, &c) || get_varint(fp, &count))
+		return -1;
+	if(da) {
+		t->a = last->a + da - 1;
+		t->b = b;
+		t->c = c;
+	}
+	else {
+		t->a = last->a;
+		t->b = b ? last->b + b : last->b;
+		t->c = b ? c : last->c + c;
+	}
+	t->count = count;
+	return 0;
+}
+
+/* Function:    load_model()
+ * Description: Rebuild a table saved with save_model() or count_words().
+ *        The model's normalization flags become the current ones.  Returns
+ *        NULL if the file is not a model or is damaged.
+ */
+
+HASH_TABLE *load_model(const char *path) {
+	unsigned char buf[HEADER_SIZE];
+	HASH_TABLE *ht = NULL;
+	NODE	**words = NULL;
+	PREC	*prec = NULL;		// edge of the last EDGE_PREC
+	TUPLE	t = {0},
+		last = {0},
+		ctx = {0};		// the last EDGE_PREC
+	FILE	*fp;
+	unsigned n,
+		i;
+	uint64_t e,
+		edges;
+
+	if(!(fp = fopen(path, "rb")))
+		return NULL;
+	if(fread(buf, 1, sizeof(buf), fp) != sizeof(buf) || memcmp(buf, MODEL_MAGIC, 4)
+	|| get_le(buf + 4, 4) != MODEL_VERSION)
+		goto fail;
+	n = get_le(buf + 8, 4);
+	edges = get_le(buf + 24, 8);
+	ht = create_table();
+	ht->count = get_le(buf + 12, 4);
+	ht->sentences = get_le(buf + 16, 4);
+	set_normalize(get_le(buf + 20, 4));
+
+	words = malloc(n * sizeof(*words) + 1);
+	assert(words);
+	for(i = 0; i < n; i++) {
+		if(!(words[i] = read_word(fp, ht)))
+			goto fail;
+		words[i]->id = i;
+	}
+	for(e = 0; e < edges; e++) {
+		if(read_edge(fp, &t, &last) || t.a >= n || t.b >= n)
+			goto fail;
+		if(t.c == EDGE_PREC) {
+			prec = load_prec(words[t.a], words[t.b], t.count);
+			ctx = t;
+		}
+		else if(t.c == EDGE_START)
+			load_succ(words[t.a], NULL, words[t.b], t.count);
+		// successors follow their own edge, see tuple_cmp()
+		else if(t.c - EDGE_SUCC < n && prec && ctx.a == t.a && ctx.b == t.b)
+			load_succ(words[t.b], prec, words[t.c - EDGE_SUCC], t.count);
+		else
+			goto fail;
+		last = t;
+	}
+	free(words);
+	fclose(fp);
+	return ht;
+
+fail:
+	free(words);
+	fclose(fp);
+	// a partial table is not worth returning
+	if(ht) {
+		clear_table(ht);
+		rem_table(ht);
+	}
+	return NULL;
+}
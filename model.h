@@ -0,0 +1,38 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdint.h>
+#include "hash.h"
+
+#define MODEL_MAGIC	"MKV1"
+#define MODEL_VERSION	1
+
+#define EDGE_PREC	0	// (a, b): a precedes b
+#define EDGE_START	1	// (a, b): a starts a sentence, b follows it
+#define EDGE_SUCC	2	// (a, b, c - EDGE_SUCC): c follows a b
+
+typedef struct {
+	uint32_t a;
+	uint32_t b;
+	uint32_t c;		// EDGE_PREC, EDGE_START or EDGE_SUCC + successor id
+	uint32_t count;
+} TUPLE;			// one counted edge, ordered by (a, b, c)
+
+typedef struct {
+	FILE	*fp;
+	TUPLE	last;		// edges are stored as deltas to the previous one
+	uint64_t edges;
+	unsigned words;
+	unsigned count;
+	unsigned sentences;
+} MODEL;			// a model being written
+
+int is_model(const char *);
+MODEL *create_model(const char *, HASH_TABLE *, NODE **, unsigned);
+void write_edge(MODEL *, TUPLE *);
+int close_model(MODEL *);
+int save_model(HASH_TABLE *, const char *);
+HASH_TABLE *load_model(const char *);
+int tuple_cmp(const void *, const void *);
+
+#endif /* MODEL_H */
@@ -1,49 +1,445 @@
 #include "parse.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
 #define MAX(a,b) \
     ({ __typeof__ (a) _a = (a); \
     __typeof__ (b) _b = (b); \
     _a > _b ? _a : _b; })
 
-static unsigned starting_apos = 0;
+static __thread unsigned starting_apos = 0;
+static unsigned norm_flags = NORM_NONE;
+
+typedef struct {
+    unsigned char len;          // 0 for an empty slot
+    char    word[ABBREV_LEN - 1];
+} ABBREV;
+
+// words whose period does not end a sentence, see set_abbrevs()
+static const char *default_abbrevs[] = {
+    "Mr.", "Mrs.", "Ms.", "Dr.", "Prof.", "Sr.", "Jr.", "St.", "Mt.",
+    "Rev.", "Gen.", "Col.", "Lt.", "Capt.", "Sgt.", "Gov.", "Sen.", "Rep.",
+    "e.g.", "i.e.", "vs.", "cf.", "U.S.", "U.K.", "No."
+};
+static ABBREV *abbrevs = NULL;
+static unsigned abbrev_mask = 0,
+    abbrev_seed = 0;
+static pthread_once_t abbrev_once = PTHREAD_ONCE_INIT;
+
+// typographic marks parse() counts like their ASCII forms
+static const char *open_quotes[] = {"\u201c", "\u201e", "\u00ab"},
+    *close_quotes[] = {"\u201d", "\u00bb"},
+    *open_apos[] = {"\u2018"},
+    *close_apos[] = {"\u2019"},
+    *ellipsis[] = {"\u2026"};
+#define MARKS(m)    (m), sizeof(m) / sizeof(*(m))
+
+/* Function:    abbrev_hash()
+ * Description:    Seeded FNV-1a of the first 'len' characters of 'word'.
+ */
+
+static unsigned abbrev_hash(const char *word, unsigned len, unsigned seed) {
+    uint32_t h = 2166136261u ^ seed;
+
+    while(len--)
+        h = (h ^ (unsigned char)*word++) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+/* Function:    set_abbrevs()
+ * Description:    Compile the abbreviations into a perfect hash: the table is
+ *        the smallest power of two at least twice the list and the seed the
+ *        first under which no two of them share a slot, so a lookup is one
+ *        hash and one comparison whatever the list size.  Not thread safe,
+ *        call it before tokenizing.  Returns -1 if a word is too long.
+ */
+
+int set_abbrevs(const char **words, unsigned n) {
+    ABBREV  *table = NULL;
+    unsigned size = 8,
+        seed,
+        i,
+        len,
+        slot;
+
+    for(i = 0; i < n; i++)
+        if(strlen(words[i]) >= ABBREV_LEN)
+            return -1;
+    while(size < 2 * n)
+        size <<= 1;
+    for(;; size <<= 1) {
+        table = realloc(table, size * sizeof(*table));
+        assert(table);
+        for(seed = 0; seed < 1024; seed++) {
+            memset(table, 0, size * sizeof(*table));
+            for(i = 0; i < n; i++) {
+                len = strlen(words[i]);
+                slot = abbrev_hash(words[i], len, seed) & (size - 1);
+                if(table[slot].len && (table[slot].len != len || memcmp(table[slot].word, words[i], len)))
+                    break;
+                table[slot].len = len;
+                memcpy(table[slot].word, words[i], len);
+            }
+            if(i == n)
+                goto found;
+        }
+    }
+found:
+    free(abbrevs);
+    abbrevs = table;
+    abbrev_mask = size - 1;
+    abbrev_seed = seed;
+    return 0;
+}
+
+/* Function:    load_abbrevs()
+ * Description:    Replace the abbreviations with the words of a file, one per
+ *        line as they are written in text, e.g. "Dr.".  Returns -1 if the
+ *        file cannot be read or a word is too long.
+ */
+
+int load_abbrevs(const char *path) {
+    FILE    *fp = fopen(path, "r");
+    char    **words = NULL,
+        buf[256],
+        *pos,
+        word[ABBREV_LEN + 1];
+    unsigned n = 0,
+        i;
+    int     ret;
+
+    if(!fp)
+        return -1;
+    while(fgets(buf, sizeof(buf), fp)) {
+        pos = buf;
+        if(!next_word(&pos, word, sizeof(word)))
+            continue;
+        words = realloc(words, (n + 1) * sizeof(*words));
+        assert(words);
+        words[n++] = strdup(word);
+    }
+    fclose(fp);
+    ret = set_abbrevs((const char **)words, n);
+    for(i = 0; i < n; i++)
+        free(words[i]);
+    free(words);
+    return ret;
+}
+
+/* Function:    init_abbrevs()
+ * Description:    Compile the default list unless one was set already.
+ */
+
+static void init_abbrevs() {
+    if(!abbrevs)
+        set_abbrevs(default_abbrevs, sizeof(default_abbrevs) / sizeof(*default_abbrevs));
+}
+
+/* Function:    is_abbrev()
+ * Description:    Is the text word[0 .. len) one of the abbreviations?
+ */
+
+unsigned is_abbrev(const char *word, unsigned len) {
+    ABBREV  *a;
+
+    if(!__atomic_load_n(&abbrevs, __ATOMIC_ACQUIRE))
+        pthread_once(&abbrev_once, init_abbrevs);
+    if(len >= ABBREV_LEN)
+        return 0;
+    a = &abbrevs[abbrev_hash(word, len, abbrev_seed) & abbrev_mask];
+    return a->len == len && !memcmp(a->word, word, len);
+}
 
 /* Function:    is_ellipsis()
  * Description:    Given a word and whether we are starting from the beginning
  *        or end of the word, determine if we have found an ellpisis (...)
+ *        The word itself is left alone, the cleaning loop in parse()
+ *        strips the periods.
  */
 
-static unsigned is_ellipsis(char *front, char *end, unsigned from_start) {
+static unsigned is_ellipsis(const char *front, const char *end, unsigned from_start) {
     unsigned periods = 0;
 
     if(from_start) 
-        while(front != end && *front == '.') {
+        while(front < end && *front == '.') {
             periods++;
             front++;
         }
-    else {
-        while(front != end && *end-- == '.') {
+    else
+        while(front < end && *end == '.') {
             periods++;
             end--;
         }
-        // 'end' starts on the last character of the word so clearing last
-        // character either clears ellipsis or does nothing
-        *(end + 1) = '\0';
-    }
     return periods;
 }
 
+/* Function:    utf8_decode()
+ * Description:    Decode the character at 's' into *cp.  Returns its length,
+ *        or 0 if 's' does not start a valid UTF-8 sequence: a stray
+ *        continuation byte, a truncated sequence, an overlong encoding, a
+ *        surrogate or anything above U+10FFFF.
+ */
+
+static unsigned utf8_decode(const char *str, uint32_t *cp) {
+    const unsigned char *s = (const unsigned char *)str;
+    unsigned len,
+        i;
+    uint32_t c;
+
+    if(s[0] < 0x80) {
+        *cp = s[0];
+        return 1;
+    }
+    if(s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+        c = s[0] & 0x1f;
+    }
+    else if(s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        c = s[0] & 0x0f;
+    }
+    else if(s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        c = s[0] & 0x07;
+    }
+    else
+        return 0;
+    for(i = 1; i < len; i++) {
+        if((s[i] & 0xc0) != 0x80)
+            return 0;
+        c = c << 6 | (s[i] & 0x3f);
+    }
+    if((len == 3 && c < 0x800) || (len == 4 && (c < 0x10000 || c > 0x10ffff)))
+        return 0;
+    if(c >= 0xd800 && c <= 0xdfff)
+        return 0;
+    *cp = c;
+    return len;
+}
+
+/* Function:    utf8_encode()
+ * Description:    Write the code point 'c' at 'dst', returning its length.
+ */
+
+static unsigned utf8_encode(uint32_t c, char *dst) {
+    unsigned char *d = (unsigned char *)dst;
+
+    if(c < 0x80) {
+        d[0] = c;
+        return 1;
+    }
+    if(c < 0x800) {
+        d[0] = 0xc0 | c >> 6;
+        d[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if(c < 0x10000) {
+        d[0] = 0xe0 | c >> 12;
+        d[1] = 0x80 | (c >> 6 & 0x3f);
+        d[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    d[0] = 0xf0 | c >> 18;
+    d[1] = 0x80 | (c >> 12 & 0x3f);
+    d[2] = 0x80 | (c >> 6 & 0x3f);
+    d[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+// letters, combining marks and digits above ASCII, sorted for is_letter()
+static const uint32_t letters[][2] = {
+    {0x00aa, 0x00aa}, {0x00b5, 0x00b5}, {0x00ba, 0x00ba}, {0x00c0, 0x00d6},
+    {0x00d8, 0x00f6}, {0x00f8, 0x02c1}, {0x02c6, 0x02d1}, {0x02e0, 0x02e4},
+    {0x0300, 0x0374}, {0x0376, 0x037d}, {0x0386, 0x0386}, {0x0388, 0x03ff},
+    {0x0400, 0x0481}, {0x0483, 0x052f}, {0x0531, 0x0556}, {0x0561, 0x0587},
+    {0x0591, 0x05bd}, {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05d0, 0x05ea},
+    {0x0610, 0x061a}, {0x0620, 0x0669}, {0x066e, 0x06d3}, {0x06d5, 0x06dc},
+    {0x06df, 0x06fc}, {0x0900, 0x0963}, {0x0966, 0x096f}, {0x0971, 0x0dff},
+    {0x0e01, 0x0e3a}, {0x0e40, 0x0e4e}, {0x0e50, 0x0e59}, {0x0e81, 0x0edf},
+    {0x10a0, 0x10ff}, {0x1100, 0x11ff}, {0x1e00, 0x1fbc}, {0x1fc2, 0x1fcc},
+    {0x1fd0, 0x1fdb}, {0x1fe0, 0x1fec}, {0x1ff2, 0x1ffc}, {0x3041, 0x3096},
+    {0x3099, 0x309a}, {0x309d, 0x309f}, {0x30a1, 0x30fa}, {0x30fc, 0x30ff},
+    {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xac00, 0xd7a3}, {0xf900, 0xfaff},
+    {0xff10, 0xff19}, {0xff21, 0xff3a}, {0xff41, 0xff5a}, {0xff66, 0xffdc},
+    {0x20000, 0x2fa1f}
+};
+
+static uint32_t short_letters[0x800 / 32];     // letters[] below U+0800
+static pthread_once_t letters_once = PTHREAD_ONCE_INIT;
+
+/* Function:    init_letters()
+ * Description:    Expand the two byte part of letters[] into a bitmap, which
+ *        covers Latin, Greek, Cyrillic, Hebrew and Arabic.
+ */
+
+static void init_letters() {
+    unsigned i;
+    uint32_t c;
+
+    for(i = 0; i < sizeof(letters) / sizeof(*letters); i++)
+        for(c = letters[i][0]; c <= letters[i][1] && c < 0x800; c++)
+            short_letters[c / 32] |= 1u << c % 32;
+}
+
+/* Function:    is_letter()
+ * Description:    Does the non-ASCII code point 'c' belong in a word?  The
+ *        table covers the letters of the Latin, Greek, Cyrillic, Armenian,
+ *        Hebrew, Arabic, Indic, Thai, Georgian and CJK blocks with their
+ *        combining marks, not all of Unicode.
+ */
+
+static unsigned is_letter(uint32_t c) {
+    unsigned lo = 0,
+        hi = sizeof(letters) / sizeof(*letters),
+        mid;
+
+    if(c < 0x800) {
+        pthread_once(&letters_once, init_letters);
+        return short_letters[c / 32] >> c % 32 & 1;
+    }
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(c < letters[mid][0])
+            hi = mid;
+        else if(c > letters[mid][1])
+            lo = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+/* Function:    to_lower()
+ * Description:    Simple lower case of 'c' for ASCII, Latin-1, Latin
+ *        Extended-A, Greek and Cyrillic, other characters are returned as
+ *        they are.  Both cases always take the same number of bytes, which
+ *        lets normalize() and apply_shape() work in place.
+ */
+
+static uint32_t to_lower(uint32_t c) {
+    if(c < 0x80)
+        return c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+    if(c >= 0xc0 && c <= 0xde && c != 0xd7)
+        return c + 0x20;
+    if(c == 0x178)
+        return 0xff;
+    if(((c >= 0x100 && c <= 0x12f) || (c >= 0x132 && c <= 0x137) || (c >= 0x14a && c <= 0x177)) && !(c & 1))
+        return c + 1;
+    if(((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) && (c & 1))
+        return c + 1;
+    if(c >= 0x391 && c <= 0x3a9 && c != 0x3a2)
+        return c + 0x20;
+    if(c >= 0x410 && c <= 0x42f)
+        return c + 0x20;
+    if(c >= 0x400 && c <= 0x40f)
+        return c + 0x50;
+    return c;
+}
+
+/* Function:    to_upper()
+ * Description:    The inverse of to_lower(), final sigma included.
+ */
+
+static uint32_t to_upper(uint32_t c) {
+    if(c < 0x80)
+        return c >= 'a' && c <= 'z' ? c - 0x20 : c;
+    if(c >= 0xe0 && c <= 0xfe && c != 0xf7)
+        return c - 0x20;
+    if(c == 0xff)
+        return 0x178;
+    if(((c >= 0x100 && c <= 0x12f) || (c >= 0x132 && c <= 0x137) || (c >= 0x14a && c <= 0x177)) && (c & 1))
+        return c - 1;
+    if(((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) && !(c & 1))
+        return c - 1;
+    if(c == 0x3c2)
+        return 0x3a3;
+    if(c >= 0x3b1 && c <= 0x3c9)
+        return c - 0x20;
+    if(c >= 0x430 && c <= 0x44f)
+        return c - 0x20;
+    if(c >= 0x450 && c <= 0x45f)
+        return c - 0x50;
+    return c;
+}
+
+/* Function:    match_front()
+ * Description:    Length of whichever of the 'n' marks the word front .. end
+ *        begins with, 0 for none.
+ */
+
+static unsigned match_front(const char *front, const char *end, const char **marks, unsigned n) {
+    unsigned i,
+        len;
+
+    for(i = 0; i < n; i++) {
+        len = strlen(marks[i]);
+        if(end - front + 1 >= (long)len && !memcmp(front, marks[i], len))
+            return len;
+    }
+    return 0;
+}
+
+/* Function:    match_back()
+ * Description:    Length of whichever of the 'n' marks the word front .. end
+ *        ends with, 0 for none.
+ */
+
+static unsigned match_back(const char *front, const char *end, const char **marks, unsigned n) {
+    unsigned i,
+        len;
+
+    for(i = 0; i < n; i++) {
+        len = strlen(marks[i]);
+        if(end - front + 1 >= (long)len && !memcmp(end - len + 1, marks[i], len))
+            return len;
+    }
+    return 0;
+}
+
+/* Function:    next_word()
+ * Description:    Copy the next whitespace separated word of the text at *pos
+ *        into buf, truncated to size - 1 characters, and advance *pos past
+ *        it.  Returns NULL at the end of the text.  Text in scripts written
+ *        without spaces, such as Chinese, Japanese or Thai, is not split
+ *        into words: a whole clause comes back as one, cut at size - 1.
+ */
+
+char *next_word(char **pos, char *buf, unsigned size) {
+    char    *p = *pos;
+    unsigned len = 0;
+
+    while(isspace((unsigned char)*p))
+        p++;
+    if(!*p)
+        return NULL;
+    for(; *p && !isspace((unsigned char)*p); p++)
+        if(len < size - 1)
+            buf[len++] = *p;
+    buf[len] = '\0';
+    *pos = p;
+    return buf;
+}
+
 /* Function:    parse()
  *        Given a word, this function will remove unsupported
  *        characters it.  The function also determines whether or
  *        not the word is at the beginning or the end of a sentence -
- *        did we find '. ? ! ,' or nothing?
+ *        did we find '. ? ! ,' or nothing?  Words holding bytes above
+ *        0x7f are decoded as UTF-8: invalid sequences are dropped and
+ *        letters of other scripts kept, typographic quotes, apostrophes
+ *        and ellipses count like their ASCII forms.
  */
 
 PUNC parse(char *word) {
     char    *dst,
         *front,
         *end;
-    unsigned len;
+    unsigned len,
+        n;
+    uint32_t c;
     PUNC    punc = {0};
 
     assert((len = strlen(word)));
@@ -62,6 +458,15 @@ PUNC parse(char *word) {
         punc.beg_apos++;
         front++;
     }
+    else if(*front & 0x80) {
+        if((n = match_front(front, end, MARKS(open_quotes))))
+            punc.beg_quotes++;
+        else if((n = match_front(front, end, MARKS(open_apos)))) {
+            starting_apos = 1;
+            punc.beg_apos++;
+        }
+        front += n;
+    }
 
     // check if word begins with an ellipsis
     unsigned count = is_ellipsis(front, end, START);
@@ -80,16 +485,30 @@ PUNC parse(char *word) {
         punc.end_apos++;
         end--;
     }
+    else if(*end & 0x80) {
+        if((n = match_back(front, end, MARKS(close_quotes))))
+            punc.end_quotes++;
+        else if(starting_apos && (n = match_back(front, end, MARKS(close_apos)))) {
+            starting_apos = 0;
+            punc.end_apos++;
+        }
+        end -= n;
+    }
 
     // check if word ends with an ellipsis
     count = is_ellipsis(front, end, END);
-    if(count > 2)
+    if(count > 2 || (!count && end >= front && (*end & 0x80) && match_back(front, end, MARKS(ellipsis))))
         punc.end_ellipsis++;
+    // "Dr." and "e.g." end in a period but not a sentence
+    else if(count == 1 && is_abbrev(front, end - front + 1))
+        punc.prefix++;
     else if(count == 1)
         punc.period++;
 
-    // do we end with !, ?, or a comma?
-    if(*end == '!') 
+    // do we end with !, ?, or a comma?  Not a lone quote.
+    if(end < front)
+        punc.nothing++;
+    else if(*end == '!') 
         punc.bang++;
     else if(*end == '?') 
         punc.question++;
@@ -98,11 +517,8 @@ PUNC parse(char *word) {
     else
         punc.nothing++;
 
-    if(!strcmp(word, MS) || !strcmp(word, MRS) || !strcmp(word, MR)) {
-        punc.prefix++;
-        punc.period = 0;
-    }
-
+    // plain ASCII never leaves this loop, the test for a high byte
+    // is only reached by characters that are dropped anyway
     front = dst = word;
     while(*front) {
         if(('a' <= *front && *front <= 'z') \
@@ -110,28 +526,324 @@ PUNC parse(char *word) {
         || *front == '\'' || *front == '-' \
         || ('0' <= *front && *front <= '9'))
             *dst++ = *front;
+        else if(*front & 0x80)
+            break;
         front++;
     }
+    while(*front) {
+        if(!(*front & 0x80)) {
+            if(('a' <= *front && *front <= 'z') \
+            || ('A' <= *front && *front <= 'Z') \
+            || *front == '\'' || *front == '-' \
+            || ('0' <= *front && *front <= '9'))
+                *dst++ = *front;
+            front++;
+        }
+        else if(!(n = utf8_decode(front, &c)))
+            front++;
+        else {
+            // "don\u2019t" is spelled like "don't"
+            if(c == 0x2018 || c == 0x2019)
+                *dst++ = '\'';
+            else if(is_letter(c))
+                for(len = 0; len < n; len++)
+                    *dst++ = front[len];
+            front += n;
+        }
+    }
     *dst = '\0';
     return punc;
 }
 
+/* Function:    ends_sentence()
+ * Description:    Would parse() end a sentence on the whitespace separated
+ *        text word[0 .. len)?  read_block() cuts blocks with it, so that
+ *        threads starting a block with a fresh cursor see the same sentences
+ *        as a serial run.  Whether a closing apostrophe ends speech depends
+ *        on the words before, so a word ending in one is only taken when it
+ *        also opens with one.
+ */
+
+unsigned ends_sentence(const char *word, unsigned len) {
+    const char *front = word,
+        *end;
+    unsigned opened = 0,
+        n = 0;
+
+    // next_word() keeps no more than this of the word
+    if(len > WORD_LEN - 1)
+        len = WORD_LEN - 1;
+    if(!len)
+        return 0;
+    end = &word[len-1];
+
+    if(*front == '"')
+        front++;
+    else if(*front == '\'') {
+        opened = 1;
+        front++;
+    }
+    else if(*front & 0x80) {
+        if(!(n = match_front(front, end, MARKS(open_quotes))))
+            opened = (n = match_front(front, end, MARKS(open_apos))) != 0;
+        front += n;
+    }
+
+    if(*end == '"')
+        end--;
+    else if(*end == '\'') {
+        if(!opened)
+            return 0;
+        end--;
+    }
+    else if(*end & 0x80) {
+        if((n = match_back(front, end, MARKS(close_quotes))))
+            end -= n;
+        else if((n = match_back(front, end, MARKS(close_apos)))) {
+            if(!opened)
+                return 0;
+            end -= n;
+        }
+    }
+
+    if(end < front)
+        return 0;
+    // "Dr." and "..." do not end a sentence
+    if(*end == '.')
+        return is_ellipsis(front, end, END) == 1 && !is_abbrev(front, end - front + 1);
+    return *end == '!' || *end == '?';
+}
+
+/* Function:    add_counts()
+ * Description:    Add 'n' byte counters from src to dst.  When one of them
+ *        would overflow every counter is halved first, which keeps the
+ *        ratios generation samples from.  Halving rounds up so a mark seen
+ *        once is not forgotten.
+ */
+
+static void add_counts(unsigned char *d, unsigned char *s, unsigned n) {
+    unsigned i,
+        halve = 0;
+
+    for(i = 0; i < n; i++)
+        if(d[i] + s[i] > PUNC_MAX)
+            halve = 1;
+    for(i = 0; i < n; i++) {
+        if(halve)
+            d[i] = (d[i] + 1) >> 1;
+        d[i] = d[i] + s[i] > PUNC_MAX ? PUNC_MAX : d[i] + s[i];
+    }
+}
+
 /* Function:    update_punc()
- * Description:    Given a destination structure of punc, add dest freq to source punc freq
+ * Description:    Add the punctuation seen on one token (src) to a node's
+ *        running counts (dst), see add_counts().
  */
 
 void update_punc(PUNC *dst, PUNC *src) {
-    src->nothing += dst->nothing;
-    src->comma += dst->comma;
-    src->prefix += dst->prefix;
-    src->period += dst->period;
-    src->question += dst->question;
-    src->bang += dst->bang;
-    src->beg_quotes += dst->beg_quotes;
-    src->end_quotes += dst->end_quotes;
-    src->beg_apos += dst->beg_apos;
-    src->end_apos += dst->end_apos;
-    src->beg_ellipsis += dst->beg_ellipsis;
-    src->end_ellipsis += dst->end_ellipsis;
+    add_counts((unsigned char *)dst, (unsigned char *)src, sizeof(PUNC));
+}
+
+/* Function:    add_counts_atomic()
+ * Description:    Add 'n' byte counters from src to dst with atomic operations
+ *        so several threads can update the same node.  A counter that would
+ *        overflow halves all of them, each byte on its own; updates racing
+ *        with the halving may be lost, which the ratios can afford.
+ */
+
+static void add_counts_atomic(unsigned char *dst, unsigned char *src, unsigned n) {
+    unsigned char old;
+    unsigned i, j;
+
+    for(i = 0; i < n; i++) {
+        if(!src[i])
+            continue;
+        old = __atomic_load_n(&dst[i], __ATOMIC_RELAXED);
+        do {
+            if(old + src[i] > PUNC_MAX) {
+                for(j = 0; j < n; j++)
+                    __atomic_store_n(&dst[j], (__atomic_load_n(&dst[j], __ATOMIC_RELAXED) + 1) >> 1, __ATOMIC_RELAXED);
+                old = __atomic_load_n(&dst[i], __ATOMIC_RELAXED);
+            }
+        } while(!__atomic_compare_exchange_n(&dst[i], &old, old + src[i] > PUNC_MAX ? PUNC_MAX : old + src[i],
+                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+}
+
+/* Function:    update_punc_atomic()
+ * Description:    update_punc() for nodes shared between threads.
+ */
+
+void update_punc_atomic(PUNC *dst, PUNC *src) {
+    add_counts_atomic((unsigned char *)dst, (unsigned char *)src, sizeof(PUNC));
+}
+
+/* Function:    reset_parse()
+ * Description:    Forget a line of speech opened with an apostrophe.  Called
+ *        before each block or line, so what parse() makes of a word does
+ *        not depend on what the thread parsed before.
+ */
+
+void reset_parse() {
+    starting_apos = 0;
+}
+
+/* Function:    set_normalize()
+ * Description:    Select the normalization normalize() applies, any of the
+ *        NORM flags or'd together.  Must be set before the table is built.
+ */
+
+void set_normalize(unsigned flags) {
+    norm_flags = flags;
+}
+
+/* Function:    get_normalize()
+ * Description:    Return the current normalization flags.
+ */
+
+unsigned get_normalize() {
+    return norm_flags;
+}
+
+/* Function:    normalize()
+ * Description:    Normalize an already parsed word in place according to the
+ *        flags given to set_normalize().  Returns the case shape the word
+ *        had before folding so its original spelling can be restored.
+ */
+
+SHAPE normalize(char *word) {
+    char    *src,
+        *dst;
+    unsigned upper = 0,
+        lower = 0,
+        first = 0,
+        ascii = 1,
+        n,
+        i;
+    uint32_t c;
+    SHAPE   shape;
+
+    for(src = word; *src; src++) {
+        if(isupper((unsigned char)*src))
+            upper++;
+        else if(islower((unsigned char)*src))
+            lower++;
+        else if(*src & 0x80) {
+            ascii = 0;
+            break;
+        }
+    }
+    // the rest of a word with a byte above 0x7f is decoded as UTF-8
+    for(; *src; src += n ? n : 1) {
+        if(!(n = utf8_decode(src, &c)))
+            continue;
+        if(to_lower(c) != c) {
+            upper++;
+            first |= src == word;
+        }
+        else if(to_upper(c) != c)
+            lower++;
+    }
+    if(!upper)
+        shape = SHAPE_LOWER;
+    else if(!lower)
+        shape = SHAPE_UPPER;
+    else if(upper == 1 && (first || isupper((unsigned char)*word)))
+        shape = SHAPE_CAPITAL;
+    else
+        shape = SHAPE_MIXED;
+
+    if(norm_flags == NORM_NONE)
+        return shape;
+    for(src = dst = word; *src; src += n) {
+        n = 1;
+        if((norm_flags & NORM_APOS) && *src == '\'')
+            continue;
+        if((norm_flags & NORM_HYPHEN) && *src == '-')
+            continue;
+        if(!(norm_flags & NORM_FOLD))
+            *dst++ = *src;
+        else if(ascii)
+            *dst++ = tolower((unsigned char)*src);
+        else if(!(n = utf8_decode(src, &c)) || to_lower(c) == c)
+            for(i = 0, n = n ? n : 1; i < n; i++)
+                *dst++ = src[i];
+        else
+            dst += utf8_encode(to_lower(c), dst);
+    }
+    *dst = '\0';
+    return shape;
 }
 
+/* Function:    update_shape()
+ * Description:    Count one more occurrence of 'shape' in a node's case
+ *        counts, halving them all when the counter is full like update_punc().
+ */
+
+void update_shape(unsigned char *counts, SHAPE shape) {
+    unsigned i;
+
+    if(counts[shape] == UCHAR_MAX)
+        for(i = 0; i < SHAPES; i++)
+            counts[i] = (counts[i] + 1) >> 1;
+    counts[shape]++;
+}
+
+/* Function:    merge_shape()
+ * Description:    Add the case counts of one node (src) to another's (dst).
+ */
+
+void merge_shape(unsigned char *dst, unsigned char *src) {
+    add_counts(dst, src, SHAPES);
+}
+
+/* Function:    update_shape_atomic()
+ * Description:    update_shape() for nodes shared between threads.
+ */
+
+void update_shape_atomic(unsigned char *counts, SHAPE shape) {
+    unsigned char one[SHAPES] = {0};
+
+    one[shape] = 1;
+    add_counts_atomic(counts, one, SHAPES);
+}
+
+/* Function:    apply_shape()
+ * Description:    Give a (folded) word the case it was most often seen in.
+ *        Mixed case cannot be rebuilt from the folded word, it is only
+ *        capitalized.
+ */
+
+void apply_shape(char *word, unsigned char *counts) {
+    unsigned i,
+        best = SHAPE_LOWER;
+
+    for(i = 0; i < SHAPES; i++)
+        if(counts[i] > counts[best])
+            best = i;
+    if(best == SHAPE_CAPITAL || best == SHAPE_MIXED)
+        capitalize(word);
+    else if(best == SHAPE_UPPER)
+        while(*word)
+            word += capitalize(word);
+}
+
+/* Function:    capitalize()
+ * Description:    Upper case the first character of 'word' in place and
+ *        return its length in bytes.
+ */
+
+unsigned capitalize(char *word) {
+    uint32_t c;
+    unsigned n;
+
+    if(!(*word & 0x80)) {
+        *word = toupper((unsigned char)*word);
+        return 1;
+    }
+    if(!(n = utf8_decode(word, &c)))
+        return 1;
+    if(to_upper(c) != c)
+        utf8_encode(to_upper(c), word);
+    return n;
+}
@@ -3,12 +3,14 @@
 
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <ctype.h>
 
-#define MR 	"Mr."
-#define MRS	"Mrs."
-#define MS	"Ms."
+#define ABBREV_LEN	16	// longest abbreviation, with its periods, plus one
+#define WORD_LEN	64	// longest word next_word() keeps, plus one
 #define START	1
 #define END	0
+#define PUNC_MAX UCHAR_MAX	// counters are halved together before overflowing
 
 typedef enum {
 	NOTHING = 0,
@@ -19,22 +21,52 @@ typedef enum {
 	BANG	= 1
 } ENDING;
 
+typedef enum {
+	NORM_NONE	= 0,
+	NORM_FOLD	= 1,	// fold case, "The" and "the" share a node
+	NORM_APOS	= 2,	// drop apostrophes, "don't" becomes "dont"
+	NORM_HYPHEN	= 4	// drop hyphens, "well-known" becomes "wellknown"
+} NORM;
+
+typedef enum {
+	SHAPE_LOWER = 0,	// "the"
+	SHAPE_CAPITAL,		// "The"
+	SHAPE_UPPER,		// "THE"
+	SHAPE_MIXED,		// "McDonald", only capitalized on output
+	SHAPES
+} SHAPE;
+
 typedef struct {
-	unsigned nothing;
-	unsigned comma;
-	unsigned prefix;
-	unsigned period;
-	unsigned question;
-	unsigned bang;
-	unsigned beg_quotes;
-	unsigned end_quotes;
-	unsigned beg_apos;
-	unsigned end_apos;
-	unsigned beg_ellipsis;
-	unsigned end_ellipsis;
-} PUNC;
+	unsigned char nothing;
+	unsigned char comma;
+	unsigned char prefix;
+	unsigned char period;
+	unsigned char question;
+	unsigned char bang;
+	unsigned char beg_quotes;
+	unsigned char end_quotes;
+	unsigned char beg_apos;
+	unsigned char end_apos;
+	unsigned char beg_ellipsis;
+	unsigned char end_ellipsis;
+} PUNC;		// small counts, stored inline in each NODE
 
+char *next_word(char **, char *, unsigned);
+int set_abbrevs(const char **, unsigned);
+int load_abbrevs(const char *);
+unsigned is_abbrev(const char *, unsigned);
 PUNC parse(char *word);
+unsigned ends_sentence(const char *, unsigned);
 void update_punc(PUNC *, PUNC *);
+void update_punc_atomic(PUNC *, PUNC *);
+void reset_parse();
+void set_normalize(unsigned);
+unsigned get_normalize();
+SHAPE normalize(char *);
+void update_shape(unsigned char *, SHAPE);
+void update_shape_atomic(unsigned char *, SHAPE);
+void merge_shape(unsigned char *, unsigned char *);
+void apply_shape(char *, unsigned char *);
+unsigned capitalize(char *);
 
 #endif /* PARSE_H */
@@ -0,0 +1,375 @@
+#include "predict.h"
+
+#include <stdint.h>
+
+/* File:        predict.c
+ * Description: Next word prediction.  Every context the table knows of is
+ *        indexed once, with its successors copied into an array sorted by
+ *        frequency, so a query is one hash lookup and the top k are the
+ *        first k choices.  The contexts are
+ *
+ *            (a, b)          the successors of the edge a -> b, prec->succ
+ *            (CTX_START, b)  the second word of a sentence, node->succ
+ *            (NULL, b)       every word seen after b, from the prec lists
+ *            (CTX_START, NULL) the first word of a sentence
+ *            (NULL, NULL)    every word by frequency
+ *
+ *        create_backward() indexes the same counts the other way round for
+ *        growing a sentence to the left of a word, see its description.
+ */
+
+/* Function:    ctx_hash()
+ * Description: Mix the two key pointers into a slot number.
+ */
+
+static size_t ctx_hash(const NODE *a, const NODE *b) {
+	uint64_t h = (uintptr_t)a * 0x9E3779B97F4A7C15ULL;
+
+	h ^= (uintptr_t)b * 0xC2B2AE3D27D4EB4FULL;
+	return h ^ (h >> 29);
+}
+
+/* Function:    find_context()
+ * Description: Return the context (a, b), NULL if it was never seen.
+ */
+
+CONTEXT *find_context(PREDICTOR *pd, NODE *a, NODE *b) {
+	size_t	i = ctx_hash(a, b) & pd->mask;
+	CONTEXT	*ctx;
+
+	for(;; i = (i + 1) & pd->mask) {
+		ctx = &pd->slot[i];
+		if(!ctx->choice)
+			return NULL;
+		if(ctx->a == a && ctx->b == b)
+			return ctx;
+	}
+}
+
+/* Function:    add_context()
+ * Description: Claim the slot for (a, b) and 'n' choices from the pool.
+ */
+
+static CONTEXT *add_context(PREDICTOR *pd, NODE *a, NODE *b, unsigned n) {
+	size_t	i = ctx_hash(a, b) & pd->mask;
+	CONTEXT	*ctx;
+
+	while(pd->slot[i].choice)
+		i = (i + 1) & pd->mask;
+	ctx = &pd->slot[i];
+	ctx->a = a;
+	ctx->b = b;
+	ctx->choice = pd->pool + pd->choices;
+	ctx->n = n;
+	pd->choices += n;
+	pd->used++;
+	return ctx;
+}
+
+#define RANK(node)	((node) == CTX_START ? 0 : (node)->id + 1)
+
+/* Function:    choice_cmp()
+ * Description: qsort() comparison, most frequent first.  Ties go by node id
+ *        so the order does not depend on the list order.
+ */
+
+static int choice_cmp(const void *x, const void *y) {
+	const CHOICE *a = x,
+		*b = y;
+
+	if(a->freq != b->freq)
+		return a->freq < b->freq ? 1 : -1;
+	return (RANK(a->node) > RANK(b->node)) - (RANK(a->node) < RANK(b->node));
+}
+
+/* Function:    finish_context()
+ * Description: Sort the choices and fill in the running sums.
+ */
+
+static void finish_context(CONTEXT *ctx) {
+	unsigned i,
+		cum = 0;
+
+	qsort(ctx->choice, ctx->n, sizeof(*ctx->choice), choice_cmp);
+	for(i = 0; i < ctx->n; i++)
+		ctx->choice[i].cum = cum += ctx->choice[i].freq;
+	ctx->total = cum;
+}
+
+/* Function:    add_succs()
+ * Description: Add the context (a, b) holding the successor list 'succ'.
+ */
+
+static void add_succs(PREDICTOR *pd, NODE *a, NODE *b, SUCC *succ, unsigned n) {
+	CONTEXT	*ctx = add_context(pd, a, b, n);
+	CHOICE	*c = ctx->choice;
+
+	for(; succ; succ = succ->next, c++) {
+		c->node = succ->node;
+		c->freq = succ->freq;
+	}
+	finish_context(ctx);
+}
+
+/* Function:    rank_nodes()
+ * Description: Return the nodes of 'ht' most frequent first, numbered by
+ *        their rank, and their number in *n.
+ */
+
+static NODE **rank_nodes(HASH_TABLE *ht, unsigned *n) {
+	NODE	**nodes,
+		*node;
+	unsigned i;
+
+	assert(ht);
+	for(*n = 0; get_next_node(ht); )
+		(*n)++;
+	nodes = malloc(*n * sizeof(*nodes) + 1);
+	assert(nodes);
+	for(i = 0; (node = get_next_node(ht)); i++)
+		nodes[i] = node;
+	qsort(nodes, *n, sizeof(*nodes), node_cmp);
+	for(i = 0; i < *n; i++)
+		nodes[i]->id = i;
+	return nodes;
+}
+
+/* Function:    alloc_predictor()
+ * Description: An empty index with room for 'contexts' contexts at no more
+ *        than half load and a pool of 'choices'.
+ */
+
+static PREDICTOR *alloc_predictor(size_t contexts, size_t choices) {
+	PREDICTOR *pd = calloc(1, sizeof(*pd));
+	size_t	size = 1;
+
+	while(size < 2 * contexts)
+		size <<= 1;
+	assert(pd);
+	pd->slot = calloc(size, sizeof(*pd->slot));
+	pd->pool = malloc((choices + 1) * sizeof(*pd->pool));
+	assert(pd->slot && pd->pool);
+	pd->mask = size - 1;
+	return pd;
+}
+
+/* Function:    create_predictor()
+ * Description: Index every context of 'ht'.  The words following b are not
+ *        kept anywhere in the table, they are gathered from the prec lists
+ *        of the words that follow it.  Node ids are renumbered as frequency
+ *        ranks.
+ */
+
+PREDICTOR *create_predictor(HASH_TABLE *ht) {
+	PREDICTOR *pd;
+	CONTEXT	**follow,	// per node id, its (NULL, b) context
+		*start,
+		*all,
+		*ctx;
+	NODE	*node,
+		**nodes;
+	PREC	*prec;
+	unsigned *followers,
+		n,
+		starters = 0,
+		i;
+	size_t	contexts = 2,
+		choices = 0;
+
+	nodes = rank_nodes(ht, &n);
+	followers = calloc(n + 1, sizeof(*followers));
+	follow = calloc(n + 1, sizeof(*follow));
+	assert(followers && follow);
+	for(i = 0; i < n; i++)
+		starters += nodes[i]->first != 0;
+	choices = n + starters;
+	for(i = 0; i < n; i++) {
+		for(prec = nodes[i]->prec; prec; prec = prec->next) {
+			followers[prec->node->id]++;
+			if(prec->succ)
+				contexts++;
+			choices += 1 + prec->num_succ;
+		}
+		if(nodes[i]->succ)
+			contexts++;
+		choices += nodes[i]->num_succ;
+	}
+	for(i = 0; i < n; i++)
+		contexts += followers[i] != 0;
+	pd = alloc_predictor(contexts, choices);
+
+	// the pool is laid out most frequent word first, its contexts together
+	all = add_context(pd, NULL, NULL, n);
+	start = add_context(pd, CTX_START, NULL, starters);
+	all->n = start->n = 0;
+	for(i = 0; i < n; i++) {
+		node = nodes[i];
+		all->choice[all->n++] = (CHOICE){node, node->freq, 0};
+		if(node->first)
+			start->choice[start->n++] = (CHOICE){node, node->first, 0};
+		if(followers[i]) {
+			follow[i] = add_context(pd, NULL, node, followers[i]);
+			follow[i]->n = 0;
+		}
+		if(node->succ)
+			add_succs(pd, CTX_START, node, node->succ, node->num_succ);
+		for(prec = node->prec; prec; prec = prec->next)
+			if(prec->succ)
+				add_succs(pd, prec->node, node, prec->succ, prec->num_succ);
+	}
+	finish_context(all);
+	finish_context(start);
+
+	// (NULL, b): b is the prec of every word that followed it
+	for(i = 0; i < n; i++)
+		for(prec = nodes[i]->prec; prec; prec = prec->next) {
+			ctx = follow[prec->node->id];
+			ctx->choice[ctx->n++] = (CHOICE){nodes[i], prec->freq, 0};
+		}
+	for(i = 0; i < n; i++)
+		if(follow[i])
+			finish_context(follow[i]);
+
+	free(nodes);
+	free(followers);
+	free(follow);
+	return pd;
+}
+
+typedef struct {
+	NODE	*c;		// word after b
+	NODE	*a;		// word before b, CTX_START if b started the sentence
+	unsigned freq;
+} BACK_EDGE;
+
+/* Function:    back_cmp()
+ * Description: qsort() comparison grouping the edges of b by the word after.
+ */
+
+static int back_cmp(const void *x, const void *y) {
+	const BACK_EDGE *a = x,
+		*b = y;
+
+	return (a->c->id > b->c->id) - (a->c->id < b->c->id);
+}
+
+/* Function:    create_backward()
+ * Description: Index 'ht' for generating right to left.  The context (b, c)
+ *        holds the words seen before b when c followed it, from the
+ *        successors of b's precs and of b starting a sentence; (NULL, b)
+ *        holds b's precs.  Both have the choice CTX_START, weighted by how
+ *        often b started a sentence in that context, which ends the walk.
+ *        Node ids are renumbered as frequency ranks.
+ */
+
+PREDICTOR *create_backward(HASH_TABLE *ht) {
+	PREDICTOR *pd;
+	CONTEXT	*ctx;
+	NODE	*node,
+		**nodes;
+	PREC	*prec;
+	SUCC	*succ;
+	BACK_EDGE *edge;
+	unsigned n,
+		i,
+		j,
+		k,
+		most = 0;
+	size_t	contexts = 0,
+		choices = 0,
+		edges;
+
+	nodes = rank_nodes(ht, &n);
+	for(i = 0; i < n; i++) {
+		edges = nodes[i]->num_succ;
+		for(prec = nodes[i]->prec; prec; prec = prec->next)
+			edges += prec->num_succ;
+		// a (b, c) context per edge at most, and (NULL, b)
+		contexts += edges + 1;
+		choices += edges + nodes[i]->sum_prec + 1;
+		if(edges > most)
+			most = edges;
+	}
+	pd = alloc_predictor(contexts, choices);
+	edge = malloc((most + 1) * sizeof(*edge));
+	assert(edge);
+
+	for(i = 0; i < n; i++) {
+		node = nodes[i];
+		ctx = add_context(pd, NULL, node, 0);
+		for(prec = node->prec; prec; prec = prec->next)
+			ctx->choice[ctx->n++] = (CHOICE){prec->node, prec->freq, 0};
+		if(node->first)
+			ctx->choice[ctx->n++] = (CHOICE){CTX_START, node->first, 0};
+		pd->choices += ctx->n;
+		finish_context(ctx);
+
+		k = 0;
+		for(succ = node->succ; succ; succ = succ->next)
+			edge[k++] = (BACK_EDGE){succ->node, CTX_START, succ->freq};
+		for(prec = node->prec; prec; prec = prec->next)
+			for(succ = prec->succ; succ; succ = succ->next)
+				edge[k++] = (BACK_EDGE){succ->node, prec->node, succ->freq};
+		qsort(edge, k, sizeof(*edge), back_cmp);
+		for(j = 0; j < k; ) {
+			ctx = add_context(pd, node, edge[j].c, 0);
+			do
+				ctx->choice[ctx->n++] = (CHOICE){edge[j].a, edge[j].freq, 0};
+			while(++j < k && edge[j].c == ctx->b);
+			pd->choices += ctx->n;
+			finish_context(ctx);
+		}
+	}
+	free(edge);
+	free(nodes);
+	return pd;
+}
+
+/* Function:    rem_predictor()
+ * Description: Free the index, the table it points into is untouched.
+ */
+
+void rem_predictor(PREDICTOR *pd) {
+	free(pd->pool);
+	free(pd->slot);
+	free(pd);
+}
+
+/* Function:    predict()
+ * Description: Return the most specific known context for the words a b,
+ *        dropping a and then b until one is found.  (CTX_START, NULL) asks
+ *        for the first word of a sentence.  The top k predictions are the
+ *        first k of ctx->choice, with probability freq / total.
+ */
+
+CONTEXT *predict(PREDICTOR *pd, NODE *a, NODE *b) {
+	CONTEXT	*ctx;
+
+	if(a && (ctx = find_context(pd, a, b)))
+		return ctx;
+	if(b && (ctx = find_context(pd, NULL, b)))
+		return ctx;
+	return find_context(pd, NULL, NULL);
+}
+
+/* Function:    sample()
+ * Description: Return the choice of 'ctx' that the uniform draw 'd' on
+ *        [0, 1) falls on, in proportion to frequency.  A binary search over
+ *        the running sums; NULL if the context is empty.
+ */
+
+NODE *sample(CONTEXT *ctx, double d) {
+	unsigned lo = 0,
+		hi = ctx->n,
+		mid,
+		r = d * ctx->total;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(ctx->choice[mid].cum <= r)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < ctx->n ? ctx->choice[lo].node : NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include "hash.h"
+
+#define CTX_START	((NODE *)1)	// 'a' for the start of a sentence, never dereferenced
+
+typedef struct {
+	NODE	*node;
+	unsigned freq;
+	unsigned cum;		// sum of freq up to and including this choice
+} CHOICE;
+
+typedef struct {
+	NODE	*a;		// two words back, NULL for one word of context
+	NODE	*b;		// previous word, NULL for the unigram or start distribution
+	CHOICE	*choice;	// most frequent first
+	unsigned n;
+	unsigned total;		// choice[n - 1].cum
+} CONTEXT;
+
+typedef struct {
+	CONTEXT	*slot;		// open addressing, keyed on (a, b)
+	size_t	mask;		// size - 1, size is a power of two
+	size_t	used;
+	CHOICE	*pool;		// every context's choices, in one allocation
+	size_t	choices;
+} PREDICTOR;
+
+PREDICTOR *create_predictor(HASH_TABLE *);
+PREDICTOR *create_backward(HASH_TABLE *);
+void rem_predictor(PREDICTOR *);
+CONTEXT *find_context(PREDICTOR *, NODE *, NODE *);
+CONTEXT *predict(PREDICTOR *, NODE *, NODE *);
+NODE *sample(CONTEXT *, double);
+
+#endif /* PREDICT_H */
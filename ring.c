@@ -0,0 +1,99 @@
+#include "ring.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <sched.h>
+#include <time.h>
+
+/* File:        ring.c
+ * Description: Bounded ring buffer connecting two pipeline stages, one
+ *        thread pushing and one popping.  Neither side takes a lock: each
+ *        owns one index and only reads the other's.  A side that finds the
+ *        ring full or empty yields, and reports how long it waited so the
+ *        stages can tell which of them is the bottleneck.
+ */
+
+/* Function:    create_ring()
+ * Description: Create a ring holding up to 'size' entries, rounded up to a
+ *        power of two.
+ */
+
+RING *create_ring(unsigned size) {
+	RING	*r;
+	unsigned n = 1;
+
+	while(n < size)
+		n <<= 1;
+	r = aligned_alloc(CACHE_LINE, sizeof(*r));
+	assert(r);
+	r->slot = malloc(n * sizeof(*r->slot));
+	assert(r->slot);
+	r->mask = n - 1;
+	r->head = r->tail = 0;
+	return r;
+}
+
+/* Function:    rem_ring()
+ * Description: Free the ring, not what is left in it.
+ */
+
+void rem_ring(RING *r) {
+	free(r->slot);
+	free(r);
+}
+
+/* Function:    wait_time()
+ * Description: Seconds since 'start'.
+ */
+
+static double wait_time(const struct timespec *start) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - start->tv_sec) + (ts.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/* Function:    ring_push()
+ * Description: Push an entry, waiting while the ring is full.  Returns the
+ *        seconds spent waiting.
+ */
+
+double ring_push(RING *r, void *item) {
+	struct timespec start;
+	unsigned tail = r->tail,
+		waiting = 0;
+	double	waited;
+
+	// the clock starts at the first failed check and stops once through
+	while(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask) {
+		if(!waiting++)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		sched_yield();
+	}
+	waited = waiting ? wait_time(&start) : 0;
+	r->slot[tail & r->mask] = item;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return waited;
+}
+
+/* Function:    ring_pop()
+ * Description: Pop an entry into *item, waiting while the ring is empty.
+ *        Returns the seconds spent waiting.
+ */
+
+double ring_pop(RING *r, void **item) {
+	struct timespec start;
+	unsigned head = r->head,
+		waiting = 0;
+	double	waited;
+
+	while(head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+		if(!waiting++)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		sched_yield();
+	}
+	waited = waiting ? wait_time(&start) : 0;
+	*item = r->slot[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return waited;
+}
@@ -0,0 +1,18 @@
+#ifndef RING_H
+#define RING_H
+
+#define CACHE_LINE	64
+
+typedef struct {
+	void	**slot;
+	unsigned mask;		// size - 1, size is a power of two
+	unsigned head __attribute__((aligned(CACHE_LINE)));	// next to pop, written by the consumer
+	unsigned tail __attribute__((aligned(CACHE_LINE)));	// next to push, written by the producer
+} RING;			// bounded single-producer single-consumer queue
+
+RING *create_ring(unsigned);
+void rem_ring(RING *);
+double ring_push(RING *, void *);
+double ring_pop(RING *, void **);
+
+#endif /* RING_H */
@@ -0,0 +1,333 @@
+#include "score.h"
+
+#include <stdint.h>
+#include <math.h>
+
+/* File:        score.c
+ * Description: Score text against a trained table.  Each word gets the
+ *        Witten-Bell interpolated probability of following the two before
+ *        it: P(c | a b) = (n(a b c) + u(a b) P(c | b)) / (n(a b) + u(a b))
+ *        where n are counts and u the number of unique successors, down to
+ *        the add-one unigram.  Every probability of a seen n-gram and every
+ *        backoff weight is computed once by create_scorer() and kept in an
+ *        open-addressing table keyed on the nodes, so scoring a word is at
+ *        most three lookups and no list walks.
+ *
+ *        The start of a sentence is the context START: the first word is
+ *        scored with the 'first' counts and the second with the successors
+ *        kept in node->succ.  The end of a sentence is scored as one more
+ *        event, P(end | last word) = (last + 1) / (freq + 2).
+ */
+
+static const char start_key;	// stands for the start of a sentence
+#define START_KEY	((const void *)&start_key)
+
+/* Function:    key_hash()
+ * Description: Mix the three key pointers into a slot number.
+ */
+
+static size_t key_hash(const void *a, const void *b, const void *c) {
+	uint64_t h = (uintptr_t)a * 0x9E3779B97F4A7C15ULL;
+
+	h ^= (uintptr_t)b * 0xC2B2AE3D27D4EB4FULL;
+	h ^= (uintptr_t)c * 0x165667B19E3779F9ULL;
+	return h ^ (h >> 29);
+}
+
+/* Function:    lookup()
+ * Description: Find the entry for (a, b, c), NULL if there is none.
+ */
+
+static SCORE_ENTRY *lookup(SCORER *sc, const void *a, const void *b, const void *c) {
+	size_t	i = key_hash(a, b, c) & sc->mask;
+	SCORE_ENTRY *e;
+
+	for(;; i = (i + 1) & sc->mask) {
+		e = &sc->slot[i];
+		if(!e->k[0])
+			return NULL;
+		if(e->k[0] == a && e->k[1] == b && e->k[2] == c)
+			return e;
+	}
+}
+
+/* Function:    add_entry()
+ * Description: Insert (a, b, c), or return it if already there.
+ */
+
+static SCORE_ENTRY *add_entry(SCORER *sc, const void *a, const void *b, const void *c) {
+	size_t	i = key_hash(a, b, c) & sc->mask;
+	SCORE_ENTRY *e;
+
+	for(;; i = (i + 1) & sc->mask) {
+		e = &sc->slot[i];
+		if(!e->k[0]) {
+			e->k[0] = a;
+			e->k[1] = b;
+			e->k[2] = c;
+			sc->used++;
+			return e;
+		}
+		if(e->k[0] == a && e->k[1] == b && e->k[2] == c)
+			return e;
+	}
+}
+
+/* Function:    witten_bell()
+ * Description: log of (n + u * exp(lower)) / (total + u), and through
+ *        *backoff the log weight u / (total + u) of the lower order.
+ */
+
+static float witten_bell(unsigned n, unsigned total, unsigned u, float lower, float *backoff) {
+	double	p = ((double)n + u * exp(lower)) / ((double)total + u);
+
+	if(backoff)
+		*backoff = u ? log((double)u / ((double)total + u)) : 0;
+	return log(p);
+}
+
+/* Function:    create_scorer()
+ * Description: Compute the probabilities of every n-gram in 'ht'.  Entries
+ *        are built lowest order first since each one interpolates with the
+ *        order below it.
+ */
+
+SCORER *create_scorer(HASH_TABLE *ht) {
+	SCORER	*sc;
+	SCORE_ENTRY *e,
+		*e2;
+	STATS	st;
+	NODE	*node;
+	PREC	*prec;
+	SUCC	*succ;
+	unsigned *follow_sum,	// per node id, times it was followed
+		*follow_num,	// and by how many different words
+		starters = 0,
+		n = 0;
+	size_t	size = 1;
+	double	vocab_total;
+	float	bo;
+
+	assert(ht);
+	table_stats(ht, &st);
+	while(size < 2 * ((size_t)st.words * 2 + st.precs + st.succs + 1))
+		size <<= 1;
+	sc = calloc(1, sizeof(*sc));
+	assert(sc);
+	sc->slot = calloc(size, sizeof(*sc->slot));
+	assert(sc->slot);
+	sc->mask = size - 1;
+
+	// number the nodes to count how often each is followed
+	while((node = get_next_node(ht))) {
+		node->id = n++;
+		starters += node->first != 0;
+	}
+	follow_sum = calloc(n + 1, sizeof(*follow_sum));
+	follow_num = calloc(n + 1, sizeof(*follow_num));
+	assert(follow_sum && follow_num);
+	while((node = get_next_node(ht)))
+		for(prec = node->prec; prec; prec = prec->next) {
+			follow_sum[prec->node->id] += prec->freq;
+			follow_num[prec->node->id]++;
+		}
+
+	// unigrams, add-one smoothed, and the first word of a sentence
+	vocab_total = (double)ht->count + n + 1;
+	sc->unknown = log(1 / vocab_total);
+	sc->end_unknown = log((ht->sentences + 1.0) / (ht->count + 2.0));
+	witten_bell(0, ht->sentences, starters, 0, &bo);
+	sc->start_backoff = bo;
+	while((node = get_next_node(ht))) {
+		e = add_entry(sc, node, NULL, NULL);
+		e->logp = log((node->freq + 1) / vocab_total);
+		e->end = log((node->last + 1.0) / (node->freq + 2.0));
+		witten_bell(0, follow_sum[node->id], follow_num[node->id], 0, &e->backoff);
+		e2 = add_entry(sc, START_KEY, node, NULL);
+		e2->logp = witten_bell(node->first, ht->sentences, starters, e->logp, NULL);
+		witten_bell(0, node->sum_succ, node->num_succ, 0, &e2->backoff);
+	}
+	// bigrams, the edges (b, c) kept in c's prec list
+	while((node = get_next_node(ht))) {
+		e = lookup(sc, node, NULL, NULL);
+		for(prec = node->prec; prec; prec = prec->next) {
+			e2 = add_entry(sc, prec->node, node, NULL);
+			e2->logp = witten_bell(prec->freq, follow_sum[prec->node->id], follow_num[prec->node->id],
+				e->logp, NULL);
+			witten_bell(0, prec->sum_succ, prec->num_succ, 0, &e2->backoff);
+		}
+	}
+	// trigrams, the successors of every edge (a, b) and of START b
+	while((node = get_next_node(ht))) {
+		for(prec = node->prec; prec; prec = prec->next)
+			for(succ = prec->succ; succ; succ = succ->next) {
+				e2 = lookup(sc, node, succ->node, NULL);
+				e = add_entry(sc, prec->node, node, succ->node);
+				e->logp = witten_bell(succ->freq, prec->sum_succ, prec->num_succ, e2->logp, NULL);
+			}
+		for(succ = node->succ; succ; succ = succ->next) {
+			e2 = lookup(sc, node, succ->node, NULL);
+			e = add_entry(sc, START_KEY, node, succ->node);
+			e->logp = witten_bell(succ->freq, node->sum_succ, node->num_succ, e2->logp, NULL);
+		}
+	}
+	free(follow_sum);
+	free(follow_num);
+	return sc;
+}
+
+/* Function:    rem_scorer()
+ * Description: Free the scorer.
+ */
+
+void rem_scorer(SCORER *sc) {
+	free(sc->slot);
+	free(sc);
+}
+
+/* Function:    score_word()
+ * Description: log P(c | a b), where a and b may be NULL for unknown words
+ *        and a may be START_KEY.  Falls back one order at a time, adding the
+ *        backoff weight of each context that had to be left.
+ */
+
+static double score_word(SCORER *sc, const void *a, NODE *b, NODE *c) {
+	SCORE_ENTRY *e,
+		*ctx;
+	double	bo = 0;
+
+	if(!c)
+		return sc->unknown;
+	if(a && b) {
+		if((e = lookup(sc, a, b, c)))
+			return e->logp;
+		if((ctx = lookup(sc, a, b, NULL)))
+			bo += ctx->backoff;
+	}
+	if(b) {
+		if((e = lookup(sc, b, c, NULL)))
+			return bo + e->logp;
+		bo += lookup(sc, b, NULL, NULL)->backoff;
+	}
+	else if(a == START_KEY) {
+		// first word of a sentence
+		if((e = lookup(sc, START_KEY, c, NULL)))
+			return e->logp;
+		bo += sc->start_backoff;
+	}
+	return bo + lookup(sc, c, NULL, NULL)->logp;
+}
+
+/* Function:    score_sentence()
+ * Description: Return the log probability of the words in 'line', which
+ *        is tokenized in place like the corpus was.  *words gets the number
+ *        of events scored (words plus ends of sentence), for perplexity.
+ */
+
+double score_sentence(SCORER *sc, HASH_TABLE *ht, char *line, unsigned *words) {
+	TOKEN	tok;
+	NODE	*node,
+		*prev = NULL;
+	const void *prev2 = START_KEY;
+	SCORE_ENTRY *e;
+	double	logp = 0;
+	unsigned n = 0,
+		first = 1;
+	char	*pos = line;
+
+	reset_parse();
+	while(next_word(&pos, tok.word, sizeof(tok.word))) {
+		make_token(&tok);
+		node = find_node(ht, tok.word);
+		logp += score_word(sc, prev2, prev, node);
+		n++;
+		// the second word follows (START, first word) unless that is unknown
+		prev2 = first && node ? START_KEY : prev;
+		prev = node;
+		first = 0;
+		if(tok.is_last) {
+			e = node ? lookup(sc, node, NULL, NULL) : NULL;
+			logp += e ? e->end : sc->end_unknown;
+			n++;
+			prev2 = START_KEY;
+			prev = NULL;
+			first = 1;
+		}
+	}
+	// a line need not end with a period, it still ends the sentence
+	if(!first) {
+		e = prev ? lookup(sc, prev, NULL, NULL) : NULL;
+		logp += e ? e->end : sc->end_unknown;
+		n++;
+	}
+	*words = n;
+	return logp;
+}
+
+typedef struct {
+	SCORER	*sc;
+	HASH_TABLE *ht;
+	char	**line;
+	double	*logp;
+	unsigned *words;
+	size_t	from;
+	size_t	to;
+} SCORE_JOB;
+
+/* Function:    score_job()
+ * Description: Thread body, score lines [from, to) of a batch.
+ */
+
+static void *score_job(void *arg) {
+	SCORE_JOB *job = arg;
+	size_t	i;
+
+	for(i = job->from; i < job->to; i++)
+		job->logp[i] = score_sentence(job->sc, job->ht, job->line[i], &job->words[i]);
+	return NULL;
+}
+
+/* Function:    score_lines()
+ * Description: Score every line of 'in', one sentence per line, and print
+ *        "log-probability<TAB>perplexity<TAB>events" for each to 'out' in
+ *        input order.  Lines are read in batches of SCORE_LINES that
+ *        'threads' threads split between them; the scorer is read-only.
+ */
+
+void score_lines(SCORER *sc, HASH_TABLE *ht, FILE *in, FILE *out, unsigned threads) {
+	char	**line = calloc(SCORE_LINES, sizeof(*line));
+	size_t	*cap = calloc(SCORE_LINES, sizeof(*cap)),
+		n,
+		i;
+	double	*logp = malloc(SCORE_LINES * sizeof(*logp));
+	unsigned *words = malloc(SCORE_LINES * sizeof(*words)),
+		t;
+	pthread_t tid[threads ? threads : 1];
+	SCORE_JOB job[threads ? threads : 1];
+
+	assert(line && cap && logp && words);
+	if(!threads)
+		threads = 1;
+	do {
+		for(n = 0; n < SCORE_LINES && getline(&line[n], &cap[n], in) != -1; n++)
+			;
+		for(t = 0; t < threads; t++) {
+			job[t] = (SCORE_JOB){sc, ht, line, logp, words, n * t / threads, n * (t + 1) / threads};
+			if(t)
+				pthread_create(&tid[t], NULL, score_job, &job[t]);
+		}
+		score_job(&job[0]);
+		for(t = 1; t < threads; t++)
+			pthread_join(tid[t], NULL);
+		for(i = 0; i < n; i++)
+			fprintf(out, "%.4f\t%.4f\t%u\n", logp[i],
+				words[i] ? exp(-logp[i] / words[i]) : 0, words[i]);
+	} while(n == SCORE_LINES);
+
+	for(i = 0; i < SCORE_LINES; i++)
+		free(line[i]);
+	free(line);
+	free(cap);
+	free(logp);
+	free(words);
+}
@@ -0,0 +1,29 @@
+#ifndef SCORE_H
+#define SCORE_H
+
+#include "hash.h"
+
+#define SCORE_LINES	65536	// sentences read per batch
+
+typedef struct {
+	const void *k[3];	// (a, b, c), unused trailing keys are NULL
+	float	logp;		// log P(c | a b), P(b | a) or P(a)
+	float	backoff;	// log weight of the lower order for this context
+	float	end;		// log P(end of sentence | a), unigram entries only
+} SCORE_ENTRY;
+
+typedef struct {
+	SCORE_ENTRY *slot;
+	size_t	mask;		// size - 1, size is a power of two
+	size_t	used;
+	float	unknown;	// log P of a word not in the table
+	float	start_backoff;	// log weight of the unigram for the first word
+	float	end_unknown;	// log P(end | unknown word)
+} SCORER;
+
+SCORER *create_scorer(HASH_TABLE *);
+void rem_scorer(SCORER *);
+double score_sentence(SCORER *, HASH_TABLE *, char *, unsigned *);
+void score_lines(SCORER *, HASH_TABLE *, FILE *, FILE *, unsigned);
+
+#endif /* SCORE_H */